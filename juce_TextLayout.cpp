@@ -23,6 +23,21 @@
   ==============================================================================
 */
 
+// The SSE2 code in this file only depends on the compiler targeting SSE2, as juce_graphics
+// doesn't define JUCE_USE_SSE_INTRINSICS.
+#if JUCE_INTEL && (defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2))
+ #define JUCE_TEXTLAYOUT_USE_SSE2 1
+
+ } // (juce namespace)
+
+ #include <emmintrin.h>
+
+ namespace juce
+ {
+#else
+ #define JUCE_TEXTLAYOUT_USE_SSE2 0
+#endif
+
 TextLayout::Glyph::Glyph (const int glyphCode_, const Point<float>& anchor_, float width_) noexcept
     : glyphCode (glyphCode_), anchor (anchor_), width (width_)
 {
@@ -63,11 +78,37 @@ TextLayout::Run::Run (const Run& other)
 {
 }
 
+#if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+TextLayout::Run::Run (Run&& other) noexcept
+    : font (static_cast <Font&&> (other.font)),
+      colour (other.colour),
+      glyphs (static_cast <Array<Glyph>&&> (other.glyphs)),
+      stringRange (other.stringRange)
+{
+}
+
+TextLayout::Run::Run (const Range<int>& range, Array<Glyph>&& glyphs_) noexcept
+    : colour (0xff000000),
+      glyphs (static_cast <Array<Glyph>&&> (glyphs_)),
+      stringRange (range)
+{
+}
+
+TextLayout::Run& TextLayout::Run::operator= (Run&& other) noexcept
+{
+    font = static_cast <Font&&> (other.font);
+    colour = other.colour;
+    glyphs = static_cast <Array<Glyph>&&> (other.glyphs);
+    stringRange = other.stringRange;
+    return *this;
+}
+#endif
+
 TextLayout::Run::~Run() noexcept {}
 
 //==============================================================================
 TextLayout::Line::Line() noexcept
-    : ascent (0.0f), descent (0.0f), leading (0.0f)
+    : ascent (0.0f), descent (0.0f), leading (0.0f), hasGlyphBoundsX (false)
 {
 }
 
@@ -75,23 +116,53 @@ TextLayout::Line::Line (const Range<int>& stringRange_, const Point<float>& line
                         const float ascent_, const float descent_, const float leading_,
                         const int numRunsToPreallocate)
     : stringRange (stringRange_), lineOrigin (lineOrigin_),
-      ascent (ascent_), descent (descent_), leading (leading_)
+      ascent (ascent_), descent (descent_), leading (leading_),
+      hasGlyphBoundsX (false)
 {
     runs.ensureStorageAllocated (numRunsToPreallocate);
 }
 
 TextLayout::Line::Line (const Line& other)
     : stringRange (other.stringRange), lineOrigin (other.lineOrigin),
-      ascent (other.ascent), descent (other.descent), leading (other.leading)
+      ascent (other.ascent), descent (other.descent), leading (other.leading),
+      glyphBoundsX (other.glyphBoundsX), hasGlyphBoundsX (other.hasGlyphBoundsX)
 {
     runs.addCopiesOf (other.runs);
 }
 
+#if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+TextLayout::Line::Line (Line&& other) noexcept
+    : runs (static_cast <OwnedArray<Run>&&> (other.runs)),
+      stringRange (other.stringRange), lineOrigin (other.lineOrigin),
+      ascent (other.ascent), descent (other.descent), leading (other.leading),
+      glyphBoundsX (other.glyphBoundsX), hasGlyphBoundsX (other.hasGlyphBoundsX)
+{
+}
+
+TextLayout::Line& TextLayout::Line::operator= (Line&& other) noexcept
+{
+    runs = static_cast <OwnedArray<Run>&&> (other.runs);
+    stringRange = other.stringRange;
+    lineOrigin = other.lineOrigin;
+    ascent = other.ascent;
+    descent = other.descent;
+    leading = other.leading;
+    glyphBoundsX = other.glyphBoundsX;
+    hasGlyphBoundsX = other.hasGlyphBoundsX;
+    return *this;
+}
+#endif
+
 TextLayout::Line::~Line() noexcept
 {
 }
 
 Range<float> TextLayout::Line::getLineBoundsX() const noexcept
+{
+    return (hasGlyphBoundsX ? glyphBoundsX : calculateGlyphBoundsX()) + lineOrigin.x;
+}
+
+Range<float> TextLayout::Line::calculateGlyphBoundsX() const noexcept
 {
     Range<float> range;
     bool isFirst = true;
@@ -104,7 +175,7 @@ Range<float> TextLayout::Line::getLineBoundsX() const noexcept
         if (run->glyphs.size() > 0)
         {
             float minX = run->glyphs.getReference(0).anchor.x;
-            float maxX = minX;
+            float maxX = minX + run->glyphs.getReference(0).width;
 
             for (int j = run->glyphs.size(); --j > 0;)
             {
@@ -126,414 +197,4068 @@ Range<float> TextLayout::Line::getLineBoundsX() const noexcept
         }
     }
 
-    return range + lineOrigin.x;
+    return range;
 }
 
 //==============================================================================
-TextLayout::TextLayout()
-    : width (0), justification (Justification::topLeft)
+namespace TextLayoutHelpers
 {
-}
+    /** Holds each distinct font used by a layout once, so that everything else can refer
+        to a font by its index, and compare fonts by comparing indexes.
+    */
+    class FontTable
+    {
+    public:
+        FontTable() noexcept {}
 
-TextLayout::TextLayout (const TextLayout& other)
-    : width (other.width),
-      justification (other.justification)
-{
-    lines.addCopiesOf (other.lines);
-}
+        int getIndexOf (const Font& font)
+        {
+            for (int i = fonts.size(); --i >= 0;)
+                if (fonts.getReference (i) == font)
+                    return i;
 
-#if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
-TextLayout::TextLayout (TextLayout&& other) noexcept
-    : lines (static_cast <OwnedArray<Line>&&> (other.lines)),
-      width (other.width),
-      justification (other.justification)
-{
-}
+            fonts.add (font);
+            return fonts.size() - 1;
+        }
 
-TextLayout& TextLayout::operator= (TextLayout&& other) noexcept
-{
-    lines = static_cast <OwnedArray<Line>&&> (other.lines);
-    width = other.width;
-    justification = other.justification;
-    return *this;
-}
-#endif
+        const Font& operator[] (const int index) const noexcept    { return fonts.getReference (index); }
+        int size() const noexcept                                   { return fonts.size(); }
+        void add (const Font& font)                                 { fonts.add (font); }
+        void clear() noexcept                                       { fonts.clearQuick(); }
 
-TextLayout& TextLayout::operator= (const TextLayout& other)
-{
-    width = other.width;
-    justification = other.justification;
-    lines.clear();
-    lines.addCopiesOf (other.lines);
-    return *this;
+    private:
+        Array<Font> fonts;
+    };
 }
 
-TextLayout::~TextLayout()
+//==============================================================================
+class TextLayout::Arena
 {
-}
+public:
+    Arena() noexcept {}
 
-float TextLayout::getHeight() const noexcept
-{
-    const Line* const lastLine = lines.getLast();
+    Line* createLine()
+    {
+        const int numSpare = spareLines.size();
 
-    return lastLine != nullptr ? lastLine->lineOrigin.y + lastLine->descent
-                               : 0;
-}
+        if (numSpare == 0)
+            return new Line();
 
-TextLayout::Line& TextLayout::getLine (const int index) const
-{
-    return *lines[index];
-}
+        Line* const line = spareLines.getUnchecked (numSpare - 1);
+        spareLines.remove (numSpare - 1, false);
 
-void TextLayout::ensureStorageAllocated (int numLinesNeeded)
-{
-    lines.ensureStorageAllocated (numLinesNeeded);
-}
+        jassert (line->runs.size() == 0);
+        line->hasGlyphBoundsX = false;
+        line->stringRange = Range<int>();
+        line->lineOrigin = Point<float>();
+        line->ascent = 0.0f;
+        line->descent = 0.0f;
+        line->leading = 0.0f;
+        return line;
+    }
 
-void TextLayout::addLine (Line* line)
-{
-    lines.add (line);
-}
+    Run* createRun (const Range<int>& stringRange, const int numGlyphsToPreallocate)
+    {
+        const int numSpare = spareRuns.size();
 
-void TextLayout::draw (Graphics& g, const Rectangle<float>& area) const
-{
-    const Point<float> origin (justification.appliedToRectangle (Rectangle<float> (0, 0, width, getHeight()), area).getPosition());
+        if (numSpare == 0)
+            return new Run (stringRange, numGlyphsToPreallocate);
 
-    LowLevelGraphicsContext& context = *g.getInternalContext();
+        Run* const run = spareRuns.getUnchecked (numSpare - 1);
+        spareRuns.remove (numSpare - 1, false);
 
-    for (int i = 0; i < getNumLines(); ++i)
+        jassert (run->glyphs.size() == 0);
+        run->font = Font();
+        run->colour = Colour (0xff000000);
+        run->stringRange = stringRange;
+        run->glyphs.ensureStorageAllocated (numGlyphsToPreallocate);
+        return run;
+    }
+
+    void recycle (OwnedArray<Line>& lines, const int startIndex = 0)
     {
-        const Line& line = getLine (i);
-        const Point<float> lineOrigin (origin + line.lineOrigin);
+        spareLines.ensureStorageAllocated (spareLines.size() + lines.size() - startIndex);
 
-        for (int j = 0; j < line.runs.size(); ++j)
+        for (int i = lines.size(); --i >= startIndex;)
         {
-            const Run* const run = line.runs.getUnchecked (j);
-            jassert (run != nullptr);
-            context.setFont (run->font);
-            context.setFill (run->colour);
+            Line* const line = lines.getUnchecked (i);
+            OwnedArray<Run>& runs = line->runs;
 
-            for (int k = 0; k < run->glyphs.size(); ++k)
+            spareRuns.ensureStorageAllocated (spareRuns.size() + runs.size());
+
+            for (int j = runs.size(); --j >= 0;)
             {
-                const Glyph& glyph = run->glyphs.getReference (k);
-                context.drawGlyph (glyph.glyphCode, AffineTransform::translation (lineOrigin.x + glyph.anchor.x,
-                                                                                  lineOrigin.y + glyph.anchor.y));
+                Run* const run = runs.getUnchecked (j);
+                run->glyphs.clearQuick();
+                spareRuns.add (run);
             }
+
+            runs.clear (false);
+            spareLines.add (line);
         }
+
+        lines.removeRange (startIndex, lines.size() - startIndex, false);
     }
-}
 
-void TextLayout::createLayout (const AttributedString& text, float maxWidth)
-{
-    lines.clear();
-    width = maxWidth;
-    justification = text.getJustification();
+    void trim (const int maxLines, const int maxRuns) noexcept
+    {
+        if (spareLines.size() > maxLines)
+            spareLines.removeRange (maxLines, spareLines.size() - maxLines);
 
-    if (! createNativeLayout (text))
-        createStandardLayout (text);
+        if (spareRuns.size() > maxRuns)
+            spareRuns.removeRange (maxRuns, spareRuns.size() - maxRuns);
+    }
 
-    recalculateWidth(text);
-}
+    ScopedPointer<GlyphStore> spareGlyphStore;
+
+private:
+    OwnedArray<Line> spareLines;
+    OwnedArray<Run> spareRuns;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (Arena);
+};
 
 //==============================================================================
-namespace TextLayoutHelpers
+class TextLayout::GlyphStore
 {
-    struct FontAndColour
+public:
+    GlyphStore() noexcept
+        : lineData (nullptr), runData (nullptr), numLines (0), numRuns (0), numGlyphs (0), isCompact (false),
+          glyphCodes (nullptr), anchorX (nullptr), anchorY (nullptr), widths (nullptr),
+          compactCodes (nullptr), compactX (nullptr), compactY (nullptr), compactWidths (nullptr)
     {
-        FontAndColour (const Font* font_) noexcept   : font (font_), colour (0xff000000) {}
+        updateViews();
+    }
 
-        const Font* font;
-        Colour colour;
+    GlyphStore (const GlyphStore& other)
+        : lineData (nullptr), runData (nullptr), numLines (0), numRuns (0), numGlyphs (0), isCompact (other.isCompact),
+          glyphCodes (nullptr), anchorX (nullptr), anchorY (nullptr), widths (nullptr),
+          compactCodes (nullptr), compactX (nullptr), compactY (nullptr), compactWidths (nullptr)
+    {
+        // a copy always owns its data, even if the original is using a block of external memory
+        lineStorage.addArray (other.lineData, other.numLines);
+        runStorage.addArray (other.runData, other.numRuns);
 
-        bool operator!= (const FontAndColour& other) const noexcept
+        if (isCompact)
         {
-            return (font != other.font && *font != *other.font) || colour != other.colour;
+            compactCodeStorage.addArray (other.compactCodes, other.numGlyphs);
+            compactXStorage.addArray (other.compactX, other.numGlyphs);
+            compactYStorage.addArray (other.compactY, other.numGlyphs);
+            compactWidthStorage.addArray (other.compactWidths, other.numGlyphs);
+        }
+        else
+        {
+            codeStorage.addArray (other.glyphCodes, other.numGlyphs);
+            xStorage.addArray (other.anchorX, other.numGlyphs);
+            yStorage.addArray (other.anchorY, other.numGlyphs);
+            widthStorage.addArray (other.widths, other.numGlyphs);
         }
-    };
 
-    struct RunAttribute
-    {
-        RunAttribute (const FontAndColour& fontAndColour_, const Range<int>& range_) noexcept
-            : fontAndColour (fontAndColour_), range (range_)
-        {}
+        fonts = other.fonts;
+        updateViews();
+    }
 
-        FontAndColour fontAndColour;
-        Range<int> range;
+    // These records are stored as-is in the binary format, so must only contain fixed-size types
+    struct LineInfo
+    {
+        int32 stringStart, stringEnd, firstRun, numRuns;
+        float originX, originY, ascent, descent, leading;
+        float minX, maxX;   // the glyph bounds, relative to the line's origin
     };
 
-    struct Token
+    struct RunInfo
     {
-        Token (const String& t, const Font& f, const Colour& c, const bool isWhitespace_)
-            : text (t), font (f), colour (c),
-              area (font.getStringWidth (t), roundToInt (f.getHeight())),
-              isWhitespace (isWhitespace_),
-              isNewLine (t.containsChar ('\n') || t.containsChar ('\r'))
-        {}
-
-        const String text;
-        const Font font;
-        const Colour colour;
-        Rectangle<int> area;
-        int line, lineHeight;
-        const bool isWhitespace, isNewLine;
-
-    private:
-        Token& operator= (const Token&);
+        int32 stringStart, stringEnd, firstGlyph, numGlyphs, fontIndex;
+        uint32 colour;
     };
 
-    class TokenList
+    void clear() noexcept
     {
-    public:
-        TokenList() noexcept  : totalLines (0) {}
+        lineStorage.clearQuick();
+        runStorage.clearQuick();
+        fonts.clear();
+        codeStorage.clearQuick();
+        xStorage.clearQuick();
+        yStorage.clearQuick();
+        widthStorage.clearQuick();
+        compactCodeStorage.clearQuick();
+        compactXStorage.clearQuick();
+        compactYStorage.clearQuick();
+        compactWidthStorage.clearQuick();
+        mappedFile = nullptr;
+        isCompact = false;
+        updateViews();
+    }
+
+    // If the compact format is requested but some of the glyphs can't be represented
+    // in it, this falls back to the full-precision columns.
+    void setLines (const OwnedArray<Line>& sourceLines, const bool useCompactFormat)
+    {
+        clear();
+
+        int totalRuns = 0, totalGlyphs = 0;
+        bool canBeCompact = useCompactFormat;
 
-        void createLayout (const AttributedString& text, TextLayout& layout)
+        for (int i = 0; i < sourceLines.size(); ++i)
         {
-            tokens.ensureStorageAllocated (64);
-            layout.ensureStorageAllocated (totalLines);
+            const Line& line = *sourceLines.getUnchecked (i);
+            totalRuns += line.runs.size();
+
+            for (int j = 0; j < line.runs.size(); ++j)
+            {
+                const Array<Glyph>& glyphs = line.runs.getUnchecked (j)->glyphs;
+                totalGlyphs += glyphs.size();
+
+                for (int k = 0; canBeCompact && k < glyphs.size(); ++k)
+                    canBeCompact = canBeStoredCompactly (glyphs.getReference (k));
+            }
+        }
 
-            addTextRuns (text);
+        isCompact = canBeCompact;
+        lineStorage.ensureStorageAllocated (sourceLines.size());
+        runStorage.ensureStorageAllocated (totalRuns);
 
-            layoutRuns ((int) layout.getWidth());
+        if (isCompact)
+        {
+            compactCodeStorage.ensureStorageAllocated (totalGlyphs);
+            compactXStorage.ensureStorageAllocated (totalGlyphs);
+            compactYStorage.ensureStorageAllocated (totalGlyphs);
+            compactWidthStorage.ensureStorageAllocated (totalGlyphs);
+        }
+        else
+        {
+            codeStorage.ensureStorageAllocated (totalGlyphs);
+            xStorage.ensureStorageAllocated (totalGlyphs);
+            yStorage.ensureStorageAllocated (totalGlyphs);
+            widthStorage.ensureStorageAllocated (totalGlyphs);
+        }
 
-            int charPosition = 0;
-            int lineStartPosition = 0;
-            int runStartPosition = 0;
+        for (int i = 0; i < sourceLines.size(); ++i)
+            addLine (*sourceLines.getUnchecked (i));
 
-            ScopedPointer<TextLayout::Line> currentLine;
-            ScopedPointer<TextLayout::Run> currentRun;
+        updateViews();
+    }
 
-            bool needToSetLineOrigin = true;
+    void createLines (OwnedArray<Line>& destLines, Arena& arena) const
+    {
+        destLines.ensureStorageAllocated (destLines.size() + numLines);
 
-            for (int i = 0; i < tokens.size(); ++i)
+        for (int i = 0; i < numLines; ++i)
+        {
+            const LineInfo& l = lineData[i];
+            Line* const line = arena.createLine();
+            line->stringRange = Range<int> (l.stringStart, l.stringEnd);
+            line->lineOrigin = Point<float> (l.originX, l.originY);
+            line->ascent = l.ascent;
+            line->descent = l.descent;
+            line->leading = l.leading;
+            line->glyphBoundsX = Range<float> (l.minX, l.maxX);
+            line->hasGlyphBoundsX = true;
+            line->runs.ensureStorageAllocated (l.numRuns);
+            destLines.add (line);
+
+            for (int j = l.firstRun; j < l.firstRun + l.numRuns; ++j)
             {
-                const Token* const t = tokens.getUnchecked (i);
-                const Point<float> tokenPos (t->area.getPosition().toFloat());
+                const RunInfo& r = runData[j];
+                Run* const run = arena.createRun (Range<int> (r.stringStart, r.stringEnd), r.numGlyphs);
+                line->runs.add (run);
+                run->font = fonts [r.fontIndex];
+                run->colour = Colour (r.colour);
+
+                for (int k = r.firstGlyph; k < r.firstGlyph + r.numGlyphs; ++k)
+                    run->glyphs.add (getGlyph (k));
+            }
+        }
+    }
 
-                Array <int> newGlyphs;
-                Array <float> xOffsets;
-                t->font.getGlyphPositions (t->text.trimEnd(), newGlyphs, xOffsets);
+    Glyph getGlyph (const int index) const noexcept
+    {
+        if (isCompact)
+            return Glyph (compactCodes[index],
+                          Point<float> (fromFixed (compactX[index]), fromFixed (compactY[index])),
+                          fromFixed (compactWidths[index]));
 
-                if (currentRun == nullptr)  currentRun  = new TextLayout::Run();
-                if (currentLine == nullptr) currentLine = new TextLayout::Line();
+        return Glyph (glyphCodes[index], Point<float> (anchorX[index], anchorY[index]), widths[index]);
+    }
 
-                currentRun->glyphs.ensureStorageAllocated (currentRun->glyphs.size() + newGlyphs.size());
+    int getNumLines() const noexcept         { return numLines; }
+    bool isUsingCompactFormat() const noexcept  { return isCompact; }
 
-                for (int j = 0; j < newGlyphs.size(); ++j)
-                {
-                    if (needToSetLineOrigin)
-                    {
-                        needToSetLineOrigin = false;
-                        currentLine->lineOrigin = tokenPos.translated (0, t->font.getAscent());
-                    }
+    float getHeight() const noexcept
+    {
+        if (numLines == 0)
+            return 0;
 
-                    const float x = xOffsets.getUnchecked (j);
-                    currentRun->glyphs.add (TextLayout::Glyph (newGlyphs.getUnchecked(j),
-                                                               Point<float> (tokenPos.getX() + x, 0),
-                                                               xOffsets.getUnchecked (j + 1) - x));
-                    ++charPosition;
-                }
+        const LineInfo& lastLine = lineData [numLines - 1];
+        return lastLine.originY + lastLine.descent;
+    }
+
+    Range<float> getLineBoundsX (const int index) const noexcept
+    {
+        const LineInfo& l = lineData[index];
+        return Range<float> (l.originX + l.minX, l.originX + l.maxX);
+    }
 
-                if (t->isWhitespace || t->isNewLine)
-                    ++charPosition;
+    void draw (LowLevelGraphicsContext& context, const Point<float>& origin) const
+    {
+        for (int i = 0; i < numLines; ++i)
+        {
+            const LineInfo& l = lineData[i];
+            const float lineX = origin.x + l.originX;
+            const float lineY = origin.y + l.originY;
 
-                const Token* const nextToken = tokens [i + 1];
+            for (int j = l.firstRun; j < l.firstRun + l.numRuns; ++j)
+            {
+                const RunInfo& r = runData[j];
+                context.setFont (fonts [r.fontIndex]);
+                context.setFill (Colour (r.colour));
 
-                if (nextToken == nullptr) // this is the last token
+                const int start = r.firstGlyph;
+                const int end = start + r.numGlyphs;
+
+                if (isCompact)
                 {
-                    addRun (currentLine, currentRun.release(), t, runStartPosition, charPosition);
-                    currentLine->stringRange = Range<int> (lineStartPosition, charPosition);
-                    layout.addLine (currentLine.release());
+                    for (int k = start; k < end; ++k)
+                        context.drawGlyph (compactCodes[k], AffineTransform::translation (lineX + fromFixed (compactX[k]),
+                                                                                          lineY + fromFixed (compactY[k])));
                 }
                 else
                 {
-                    if (t->font != nextToken->font || t->colour != nextToken->colour)
-                    {
-                        addRun (currentLine, currentRun.release(), t, runStartPosition, charPosition);
-                        runStartPosition = charPosition;
-                    }
-
-                    if (t->line != nextToken->line)
-                    {
-                        if (currentRun == nullptr)
-                            currentRun = new TextLayout::Run();
-
-                        addRun (currentLine, currentRun.release(), t, runStartPosition, charPosition);
-                        currentLine->stringRange = Range<int> (lineStartPosition, charPosition);
-                        layout.addLine (currentLine.release());
-
-                        runStartPosition = charPosition;
-                        lineStartPosition = charPosition;
-                        needToSetLineOrigin = true;
-                    }
+                    for (int k = start; k < end; ++k)
+                        context.drawGlyph (glyphCodes[k], AffineTransform::translation (lineX + anchorX[k],
+                                                                                        lineY + anchorY[k]));
                 }
             }
+        }
+    }
 
-            if ((text.getJustification().getFlags() & (Justification::right | Justification::horizontallyCentred)) != 0)
-            {
-                const int totalW = (int) layout.getWidth();
-                const bool isCentred = (text.getJustification().getFlags() & Justification::horizontallyCentred) != 0;
+    //==============================================================================
+    /*  The binary format is a FileHeader, followed by the line records, the run records,
+        the four glyph columns and finally the font table. Every section starts on a 4-byte
+        boundary, and all values use the byte order of the machine that wrote them, so that
+        a file can be mapped into memory and drawn from directly.
+    */
+    struct FileHeader
+    {
+        uint32 magic, version, flags;
+        float width;
+        int32 justification;
+        int32 numLines, numRuns, numGlyphs, numFonts;
+        uint32 fontTableSize;
+    };
 
-                for (int i = 0; i < layout.getNumLines(); ++i)
-                {
-                    float dx = (float) (totalW - getLineWidth (i));
+    enum
+    {
+        fileMagic = 0x4a544c42, // 'JTLB'
+        fileVersion = 1,
+        compactFlag = 1,
+        minFontRecordSize = 15  // two empty strings, three floats and a bool
+    };
 
-                    if (isCentred)
-                        dx /= 2.0f;
+    void writeToStream (OutputStream& out, const float width, const Justification& justification) const
+    {
+        static_jassert (sizeof (FileHeader) == 40 && sizeof (LineInfo) == 44 && sizeof (RunInfo) == 24);
 
-                    layout.getLine(i).lineOrigin.x += dx;
-                }
-            }
-        }
+        MemoryOutputStream fontTable;
 
-    private:
-        static void addRun (TextLayout::Line* glyphLine, TextLayout::Run* glyphRun,
-                            const Token* const t, const int start, const int end)
+        for (int i = 0; i < fonts.size(); ++i)
         {
-            glyphRun->stringRange = Range<int> (start, end);
-            glyphRun->font = t->font;
-            glyphRun->colour = t->colour;
-            glyphLine->ascent = jmax (glyphLine->ascent, t->font.getAscent());
-            glyphLine->descent = jmax (glyphLine->descent, t->font.getDescent());
-            glyphLine->runs.add (glyphRun);
+            const Font& f = fonts[i];
+            fontTable.writeString (f.getTypefaceName());
+            fontTable.writeString (f.getTypefaceStyle());
+            fontTable.writeFloat (f.getHeight());
+            fontTable.writeFloat (f.getHorizontalScale());
+            fontTable.writeFloat (f.getExtraKerningFactor());
+            fontTable.writeBool (f.isUnderlined());
         }
 
-        static int getCharacterType (const juce_wchar c) noexcept
-        {
-            if (c == '\r' || c == '\n')
-                return 0;
+        FileHeader header;
+        header.magic = fileMagic;
+        header.version = fileVersion;
+        header.flags = isCompact ? compactFlag : 0;
+        header.width = width;
+        header.justification = justification.getFlags();
+        header.numLines = numLines;
+        header.numRuns = numRuns;
+        header.numGlyphs = numGlyphs;
+        header.numFonts = fonts.size();
+        header.fontTableSize = (uint32) fontTable.getDataSize();
 
-            return CharacterFunctions::isWhitespace (c) ? 2 : 1;
-        }
+        out.write (&header, sizeof (header));
+        out.write (lineData, sizeof (LineInfo) * (size_t) numLines);
+        out.write (runData, sizeof (RunInfo) * (size_t) numRuns);
 
-        void appendText (const AttributedString& text, const Range<int>& stringRange,
-                         const Font& font, const Colour& colour)
+        if (isCompact)
         {
-            const String stringText (text.getText().substring (stringRange.getStart(), stringRange.getEnd()));
-            String::CharPointerType t (stringText.getCharPointer());
-            String currentString;
-            int lastCharType = 0;
+            writePadded (out, compactCodes,  sizeof (uint16) * (size_t) numGlyphs);
+            writePadded (out, compactX,      sizeof (int32)  * (size_t) numGlyphs);
+            writePadded (out, compactY,      sizeof (int16)  * (size_t) numGlyphs);
+            writePadded (out, compactWidths, sizeof (uint16) * (size_t) numGlyphs);
+        }
+        else
+        {
+            writePadded (out, glyphCodes, sizeof (int)   * (size_t) numGlyphs);
+            writePadded (out, anchorX,    sizeof (float) * (size_t) numGlyphs);
+            writePadded (out, anchorY,    sizeof (float) * (size_t) numGlyphs);
+            writePadded (out, widths,     sizeof (float) * (size_t) numGlyphs);
+        }
 
-            for (;;)
-            {
-                const juce_wchar c = t.getAndAdvance();
-                if (c == 0)
-                    break;
+        out.write (fontTable.getData(), fontTable.getDataSize());
+    }
 
-                const int charType = getCharacterType (c);
+    // Points the store at a block of data created by writeToStream(). The glyph and line
+    // data isn't copied, so the memory must stay valid for as long as the store uses it.
+    bool loadFromMemory (const void* const sourceData, const size_t dataSize,
+                         float& width, Justification& justification)
+    {
+        clear();
 
-                if (charType == 0 || charType != lastCharType)
-                {
-                    if (currentString.isNotEmpty())
-                        tokens.add (new Token (currentString, font, colour,
-                                               lastCharType == 2 || lastCharType == 0));
+        if (sourceData == nullptr || dataSize < sizeof (FileHeader) || (((pointer_sized_int) sourceData) & 3) != 0)
+            return false;
 
-                    currentString = String::charToString (c);
+        const char* const start = static_cast <const char*> (sourceData);
+        const FileHeader& header = *reinterpret_cast <const FileHeader*> (start);
 
-                    if (c == '\r' && *t == '\n')
-                        currentString += t.getAndAdvance();
-                }
-                else
-                {
-                    currentString += c;
-                }
+        if (header.magic != (uint32) fileMagic || header.version != (uint32) fileVersion
+             || header.numLines < 0 || header.numRuns < 0 || header.numGlyphs < 0 || header.numFonts < 0)
+            return false;
 
-                lastCharType = charType;
-            }
+        // (the sizes are worked out in 64 bits, as the counts come from the file, and multiplying
+        // them up could overflow a 32-bit size_t)
+        const bool compact = (header.flags & compactFlag) != 0;
+        const uint64 n = (uint64) header.numGlyphs;
+        const uint64 linesOffset  = sizeof (FileHeader);
+        const uint64 runsOffset   = linesOffset + sizeof (LineInfo) * (uint64) header.numLines;
+        const uint64 codesOffset  = runsOffset  + sizeof (RunInfo)  * (uint64) header.numRuns;
+        const uint64 xOffset      = codesOffset + padded64 ((compact ? sizeof (uint16) : sizeof (int))   * n);
+        const uint64 yOffset      = xOffset     + padded64 ((compact ? sizeof (int32)  : sizeof (float)) * n);
+        const uint64 widthsOffset = yOffset     + padded64 ((compact ? sizeof (int16)  : sizeof (float)) * n);
+        const uint64 fontsOffset  = widthsOffset + padded64 ((compact ? sizeof (uint16) : sizeof (float)) * n);
 
-            if (currentString.isNotEmpty())
-                tokens.add (new Token (currentString, font, colour, lastCharType == 2));
-        }
+        if (fontsOffset + header.fontTableSize > (uint64) dataSize
+             || (uint64) header.numFonts * minFontRecordSize > header.fontTableSize)
+            return false;
 
-        void layoutRuns (const int maxWidth)
         {
-            int x = 0, y = 0, h = 0;
-            int i;
+            MemoryInputStream fontTable (start + fontsOffset, header.fontTableSize, false);
 
-            for (i = 0; i < tokens.size(); ++i)
+            for (int i = 0; i < header.numFonts; ++i)
             {
-                Token* const t = tokens.getUnchecked(i);
-                t->area.setPosition (x, y);
-                t->line = totalLines;
-                x += t->area.getWidth();
-                h = jmax (h, t->area.getHeight());
-
-                const Token* const nextTok = tokens[i + 1];
-
-                if (nextTok == nullptr)
-                    break;
-
-                if (t->isNewLine || ((! nextTok->isWhitespace) && x + nextTok->area.getWidth() > maxWidth))
+                if (fontTable.isExhausted())
                 {
-                    setLastLineHeight (i + 1, h);
-                    x = 0;
-                    y += h;
-                    h = 0;
-                    ++totalLines;
+                    clear();
+                    return false;
                 }
-            }
 
-            setLastLineHeight (jmin (i + 1, tokens.size()), h);
-            ++totalLines;
-        }
+                const String name (fontTable.readString());
+                const String style (fontTable.readString());
+                Font f (name, style, fontTable.readFloat());
+                f.setHorizontalScale (fontTable.readFloat());
+                f.setExtraKerningFactor (fontTable.readFloat());
+                f.setUnderline (fontTable.readBool());
+                fonts.add (f);
+            }
 
-        void setLastLineHeight (int i, const int height) noexcept
-        {
-            while (--i >= 0)
+            if (fontTable.getPosition() > (int64) header.fontTableSize)
             {
-                Token* const tok = tokens.getUnchecked (i);
-
-                if (tok->line == totalLines)
-                    tok->lineHeight = height;
-                else
-                    break;
+                clear();
+                return false;
             }
         }
 
-        int getLineWidth (const int lineNumber) const noexcept
-        {
-            int maxW = 0;
+        const LineInfo* const lines = reinterpret_cast <const LineInfo*> (start + linesOffset);
+        const RunInfo* const runs = reinterpret_cast <const RunInfo*> (start + runsOffset);
 
-            for (int i = tokens.size(); --i >= 0;)
-            {
-                const Token* const t = tokens.getUnchecked (i);
+        if (! recordsAreValid (lines, header.numLines, runs, header.numRuns, header.numGlyphs, header.numFonts))
+        {
+            clear();
+            return false;
+        }
 
-                if (t->line == lineNumber && ! t->isWhitespace)
-                    maxW = jmax (maxW, t->area.getRight());
-            }
+        isCompact = compact;
+        lineData = lines;
+        runData = runs;
+        numLines = header.numLines;
+        numRuns = header.numRuns;
+        numGlyphs = header.numGlyphs;
 
-            return maxW;
+        if (compact)
+        {
+            compactCodes  = reinterpret_cast <const uint16*> (start + codesOffset);
+            compactX      = reinterpret_cast <const int32*>  (start + xOffset);
+            compactY      = reinterpret_cast <const int16*>  (start + yOffset);
+            compactWidths = reinterpret_cast <const uint16*> (start + widthsOffset);
+        }
+        else
+        {
+            glyphCodes = reinterpret_cast <const int*>   (start + codesOffset);
+            anchorX    = reinterpret_cast <const float*> (start + xOffset);
+            anchorY    = reinterpret_cast <const float*> (start + yOffset);
+            widths     = reinterpret_cast <const float*> (start + widthsOffset);
+        }
+
+        width = header.width;
+        justification = Justification (header.justification);
+        return true;
+    }
+
+    TextLayoutHelpers::FontTable fonts;
+    ScopedPointer<MemoryMappedFile> mappedFile;
+
+private:
+    // Views of the current data, which is either in the arrays below, or in external memory
+    const LineInfo* lineData;
+    const RunInfo* runData;
+    int numLines, numRuns, numGlyphs;
+    bool isCompact;
+
+    const int* glyphCodes;
+    const float* anchorX;
+    const float* anchorY;
+    const float* widths;
+
+    // In compact format, glyph codes are 16-bit, and positions are in 1/64ths of a pixel
+    const uint16* compactCodes;
+    const int32* compactX;
+    const int16* compactY;
+    const uint16* compactWidths;
+
+    Array<LineInfo> lineStorage;
+    Array<RunInfo> runStorage;
+    Array<int> codeStorage;
+    Array<float> xStorage, yStorage, widthStorage;
+    Array<uint16> compactCodeStorage;
+    Array<int32> compactXStorage;
+    Array<int16> compactYStorage;
+    Array<uint16> compactWidthStorage;
+
+    enum { fixedPointScale = 64 };
+
+    static float fromFixed (const int value) noexcept      { return value * (1.0f / fixedPointScale); }
+    static int toFixed (const float value) noexcept        { return roundToInt (value * fixedPointScale); }
+
+    static size_t padded (const size_t numBytes) noexcept  { return (numBytes + 3) & ~(size_t) 3; }
+    static uint64 padded64 (const uint64 numBytes) noexcept { return (numBytes + 3) & ~(uint64) 3; }
+
+    static void writePadded (OutputStream& out, const void* const source, const size_t numBytes)
+    {
+        out.write (source, numBytes);
+
+        const char zeros[4] = { 0 };
+        out.write (zeros, padded (numBytes) - numBytes);
+    }
+
+    static bool canBeStoredCompactly (const Glyph& glyph) noexcept
+    {
+        const float maxInt32 = 2147483647.0f / fixedPointScale;
+
+        return isPositiveAndBelow (glyph.glyphCode, 0x10000)
+                && std::abs (glyph.anchor.x) < maxInt32
+                && isPositiveAndBelow (toFixed (glyph.anchor.y) + 0x8000, 0x10000)
+                && isPositiveAndBelow (toFixed (glyph.width), 0x10000);
+    }
+
+    static bool recordsAreValid (const LineInfo* const lines, const int totalLines,
+                                 const RunInfo* const runs, const int totalRuns,
+                                 const int totalGlyphs, const int totalFonts) noexcept
+    {
+        for (int i = 0; i < totalLines; ++i)
+            if (lines[i].firstRun < 0 || lines[i].numRuns < 0 || lines[i].firstRun > totalRuns - lines[i].numRuns)
+                return false;
+
+        for (int i = 0; i < totalRuns; ++i)
+            if (runs[i].firstGlyph < 0 || runs[i].numGlyphs < 0 || runs[i].firstGlyph > totalGlyphs - runs[i].numGlyphs
+                 || ! isPositiveAndBelow (runs[i].fontIndex, totalFonts))
+                return false;
+
+        return true;
+    }
+
+    void updateViews() noexcept
+    {
+        lineData = lineStorage.getRawDataPointer();
+        runData = runStorage.getRawDataPointer();
+        numLines = lineStorage.size();
+        numRuns = runStorage.size();
+        numGlyphs = isCompact ? compactCodeStorage.size() : codeStorage.size();
+
+        glyphCodes = codeStorage.getRawDataPointer();
+        anchorX = xStorage.getRawDataPointer();
+        anchorY = yStorage.getRawDataPointer();
+        widths = widthStorage.getRawDataPointer();
+
+        compactCodes = compactCodeStorage.getRawDataPointer();
+        compactX = compactXStorage.getRawDataPointer();
+        compactY = compactYStorage.getRawDataPointer();
+        compactWidths = compactWidthStorage.getRawDataPointer();
+    }
+
+    void addLine (const Line& line)
+    {
+        LineInfo l;
+        l.stringStart = line.stringRange.getStart();
+        l.stringEnd   = line.stringRange.getEnd();
+        l.firstRun    = runStorage.size();
+        l.numRuns     = line.runs.size();
+        l.originX     = line.lineOrigin.x;
+        l.originY     = line.lineOrigin.y;
+        l.ascent      = line.ascent;
+        l.descent     = line.descent;
+        l.leading     = line.leading;
+
+        const Range<float> bounds (line.getLineBoundsX() - line.lineOrigin.x);
+        l.minX = bounds.getStart();
+        l.maxX = bounds.getEnd();
+
+        lineStorage.add (l);
+
+        for (int i = 0; i < line.runs.size(); ++i)
+        {
+            const Run& run = *line.runs.getUnchecked (i);
+
+            RunInfo r;
+            r.stringStart = run.stringRange.getStart();
+            r.stringEnd   = run.stringRange.getEnd();
+            r.firstGlyph  = isCompact ? compactCodeStorage.size() : codeStorage.size();
+            r.numGlyphs   = run.glyphs.size();
+            r.fontIndex   = fonts.getIndexOf (run.font);
+            r.colour      = run.colour.getARGB();
+            runStorage.add (r);
+
+            for (int j = 0; j < run.glyphs.size(); ++j)
+            {
+                const Glyph& glyph = run.glyphs.getReference (j);
+
+                if (isCompact)
+                {
+                    compactCodeStorage.add ((uint16) glyph.glyphCode);
+                    compactXStorage.add ((int32) toFixed (glyph.anchor.x));
+                    compactYStorage.add ((int16) toFixed (glyph.anchor.y));
+                    compactWidthStorage.add ((uint16) toFixed (glyph.width));
+                }
+                else
+                {
+                    codeStorage.add (glyph.glyphCode);
+                    xStorage.add (glyph.anchor.x);
+                    yStorage.add (glyph.anchor.y);
+                    widthStorage.add (glyph.width);
+                }
+            }
+        }
+    }
+
+    GlyphStore& operator= (const GlyphStore&);
+
+    JUCE_LEAK_DETECTOR (GlyphStore);
+};
+
+//==============================================================================
+class TextLayout::SharedData  : public ReferenceCountedObject
+{
+public:
+    SharedData() noexcept {}
+
+    void copyFrom (const SharedData& other)
+    {
+        lines.addCopiesOf (other.lines);
+
+        if (other.glyphStore != nullptr)
+            glyphStore = new GlyphStore (*other.glyphStore);
+    }
+
+    OwnedArray<Line> lines;
+    ScopedPointer<GlyphStore> glyphStore;
+
+    typedef ReferenceCountedObjectPtr<SharedData> Ptr;
+
+private:
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SharedData);
+};
+
+//==============================================================================
+TextLayout::TextLayout()
+    : width (0), justification (Justification::topLeft), storageMode (objectStorage),
+      shapedTextWidth (0)
+{
+}
+
+TextLayout::TextLayout (const TextLayout& other)
+    : data (other.data),
+      width (other.width),
+      justification (other.justification),
+      storageMode (other.storageMode),
+      shapedTextWidth (0)
+{
+}
+
+#if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+TextLayout::TextLayout (TextLayout&& other) noexcept
+    : data (other.data),
+      arena (other.arena.release()),
+      width (other.width),
+      justification (other.justification),
+      storageMode (other.storageMode),
+      shapedText (other.shapedText.release()),
+      shapedTextWidth (other.shapedTextWidth)
+{
+    other.data = nullptr;
+}
+
+TextLayout& TextLayout::operator= (TextLayout&& other) noexcept
+{
+    if (this != &other)
+    {
+        // the old lines go back to the pool, just as they would if this layout were deleted
+        releaseStorageToPool();
+
+        data = other.data;
+        other.data = nullptr;
+        arena = other.arena.release();
+        width = other.width;
+        justification = other.justification;
+        storageMode = other.storageMode;
+        shapedText = other.shapedText.release();
+        shapedTextWidth = other.shapedTextWidth;
+    }
+
+    return *this;
+}
+#endif
+
+TextLayout& TextLayout::operator= (const TextLayout& other)
+{
+    if (data != other.data)
+    {
+        clearLines();
+        data = other.data;
+    }
+
+    shapedText = nullptr;
+
+    width = other.width;
+    justification = other.justification;
+    storageMode = other.storageMode;
+    return *this;
+}
+
+TextLayout::~TextLayout()
+{
+    releaseStorageToPool();
+}
+
+//==============================================================================
+/*  Each thread keeps a few arenas and SharedData objects from layouts that it has deleted, so
+    that when layouts are repeatedly created and destroyed, their storage can be re-used.
+*/
+class TextLayout::StoragePool
+{
+public:
+    StoragePool() noexcept {}
+
+    class Registry;
+    class ScopedAccess;
+
+    void clear()
+    {
+        arenas.clear();
+        spareData.clear();
+    }
+
+    Arena* takeArena()
+    {
+        const int num = arenas.size();
+
+        if (num == 0)
+            return nullptr;
+
+        Arena* const a = arenas.getUnchecked (num - 1);
+        arenas.remove (num - 1, false);
+        return a;
+    }
+
+    SharedData::Ptr takeData()
+    {
+        const int num = spareData.size();
+
+        if (num == 0)
+            return nullptr;
+
+        const SharedData::Ptr d (spareData.getUnchecked (num - 1));
+        spareData.remove (num - 1);
+        return d;
+    }
+
+    void add (Arena* const a, SharedData* const d)
+    {
+        const int maxLayouts = maxLayoutsPerThread.get();
+
+        if (a != nullptr)
+        {
+            if (arenas.size() < maxLayouts)
+            {
+                a->trim (maxLinesPerLayout.get(), maxRunsPerLayout.get());
+                arenas.add (a);
+            }
+            else
+            {
+                delete a;
+            }
+        }
+
+        if (d != nullptr && spareData.size() < maxLayouts)
+            spareData.add (d);
+    }
+
+    static Atomic<int> maxLayoutsPerThread, maxLinesPerLayout, maxRunsPerLayout;
+
+private:
+    OwnedArray<Arena> arenas;
+    ReferenceCountedArray<SharedData> spareData;
+
+    JUCE_DECLARE_NON_COPYABLE (StoragePool);
+};
+
+/*  The pools are deleted along with the other DeletedAtShutdown objects, so the Lines,
+    Runs and arenas in them are gone before the leak detectors that count them are. Any
+    layouts that are deleted after that just delete their storage, until JUCE is initialised
+    again (e.g. when a host reloads a plugin), which is spotted by there being a different
+    MessageManager.
+
+    Each ScopedAccess counts as a user of the registry, and the registry's destructor waits
+    for any other threads to finish with their pools before they're deleted.
+*/
+class TextLayout::StoragePool::Registry  : public DeletedAtShutdown
+{
+public:
+    Registry() noexcept {}
+
+    ~Registry()
+    {
+        {
+            const SpinLock::ScopedLockType sl (lock);
+            instance = nullptr;
+            hasBeenDeleted = true;
+            messageManagerAtShutdown = MessageManager::getInstanceWithoutCreating();
+        }
+
+        while (numUsers.get() > 0)
+            Thread::yield();
+    }
+
+    static Registry* acquire (const bool canCreate)
+    {
+        const SpinLock::ScopedLockType sl (lock);
+
+        if (canCreate && hasBeenDeleted)
+        {
+            MessageManager* const mm = MessageManager::getInstanceWithoutCreating();
+            hasBeenDeleted = (mm == nullptr || mm == messageManagerAtShutdown);
+        }
+
+        if (instance == nullptr && canCreate && ! hasBeenDeleted)
+            instance = new Registry();
+
+        if (instance != nullptr)
+            ++(instance->numUsers);
+
+        return instance;
+    }
+
+    void release() noexcept
+    {
+        --numUsers;
+    }
+
+    ThreadLocalValue<StoragePool> pools;
+
+private:
+    Atomic<int> numUsers;
+
+    static SpinLock lock;
+    static Registry* instance;
+    static bool hasBeenDeleted;
+    static const void* messageManagerAtShutdown;
+
+    JUCE_DECLARE_NON_COPYABLE (Registry);
+};
+
+//==============================================================================
+/*  Gives access to the current thread's pool, if there is one, and stops the pools from
+    being deleted at shutdown until it goes out of scope.
+*/
+class TextLayout::StoragePool::ScopedAccess
+{
+public:
+    ScopedAccess (const bool canCreate)  : registry (Registry::acquire (canCreate)) {}
+    ~ScopedAccess()                      { if (registry != nullptr) registry->release(); }
+
+    StoragePool* getPool() const         { return registry != nullptr ? &(registry->pools.get()) : nullptr; }
+
+    void releasePool()
+    {
+        if (registry != nullptr)
+        {
+            registry->pools.get().clear();
+            registry->pools.releaseCurrentThreadStorage();
+        }
+    }
+
+private:
+    Registry* const registry;
+
+    JUCE_DECLARE_NON_COPYABLE (ScopedAccess);
+};
+
+Atomic<int> TextLayout::StoragePool::maxLayoutsPerThread (64);
+Atomic<int> TextLayout::StoragePool::maxLinesPerLayout (256);
+Atomic<int> TextLayout::StoragePool::maxRunsPerLayout (1024);
+SpinLock TextLayout::StoragePool::Registry::lock;
+TextLayout::StoragePool::Registry* TextLayout::StoragePool::Registry::instance = nullptr;
+bool TextLayout::StoragePool::Registry::hasBeenDeleted = false;
+const void* TextLayout::StoragePool::Registry::messageManagerAtShutdown = nullptr;
+
+void TextLayout::setStoragePoolLimits (const int maxLayoutsPerThread, const int maxLinesPerLayout,
+                                       const int maxRunsPerLayout)
+{
+    StoragePool::maxLayoutsPerThread = jmax (0, maxLayoutsPerThread);
+    StoragePool::maxLinesPerLayout   = jmax (0, maxLinesPerLayout);
+    StoragePool::maxRunsPerLayout    = jmax (0, maxRunsPerLayout);
+}
+
+void TextLayout::releaseCurrentThreadStorage()
+{
+    StoragePool::ScopedAccess access (false);
+    access.releasePool();
+}
+
+void TextLayout::releaseStorageToPool()
+{
+    if (arena == nullptr && data == nullptr)
+        return;
+
+    clearLines();
+
+    const StoragePool::ScopedAccess access (true);
+    StoragePool* const pool = access.getPool();
+
+    if (pool != nullptr)
+    {
+        SharedData* const unusedData = (data != nullptr && data->getReferenceCount() == 1) ? data.getObject() : nullptr;
+        pool->add (arena.release(), unusedData);
+    }
+
+    data = nullptr;
+}
+
+float TextLayout::getHeight() const noexcept
+{
+    if (data == nullptr)
+        return 0;
+
+    if (data->glyphStore != nullptr)
+        return data->glyphStore->getHeight();
+
+    const Line* const lastLine = data->lines.getLast();
+
+    return lastLine != nullptr ? lastLine->lineOrigin.y + lastLine->descent
+                               : 0;
+}
+
+int TextLayout::getNumLines() const noexcept
+{
+    if (data == nullptr)
+        return 0;
+
+    return data->glyphStore != nullptr ? data->glyphStore->getNumLines()
+                                       : data->lines.size();
+}
+
+TextLayout::Line& TextLayout::getLine (const int index) const
+{
+    // the line may be about to be changed, so it can't be re-used by a later relayout
+    shapedText = nullptr;
+
+    expandLines();
+    Line& line = *getWritableData().lines [index];
+
+    // the caller may be about to change the glyphs, so the bounds will need re-measuring
+    line.hasGlyphBoundsX = false;
+    return line;
+}
+
+void TextLayout::ensureStorageAllocated (int numLinesNeeded)
+{
+    getWritableData().lines.ensureStorageAllocated (numLinesNeeded);
+}
+
+void TextLayout::addLine (Line* line)
+{
+    expandLines();
+    getWritableData().lines.add (line);
+}
+
+#if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+void TextLayout::addLine (Line&& line)
+{
+    Line* const newLine = createLine();
+    *newLine = static_cast <Line&&> (line);
+    addLine (newLine);
+}
+#endif
+
+TextLayout::Line* TextLayout::createLine()
+{
+    return getArena().createLine();
+}
+
+TextLayout::Line* TextLayout::createLine (const Range<int>& stringRange, const Point<float>& lineOrigin,
+                                          const float ascent, const float descent, const float leading,
+                                          const int numRunsToPreallocate)
+{
+    Line* const line = getArena().createLine();
+    line->stringRange = stringRange;
+    line->lineOrigin = lineOrigin;
+    line->ascent = ascent;
+    line->descent = descent;
+    line->leading = leading;
+    line->runs.ensureStorageAllocated (numRunsToPreallocate);
+    return line;
+}
+
+TextLayout::Run* TextLayout::createRun (const Range<int>& stringRange, const int numGlyphsToPreallocate)
+{
+    return getArena().createRun (stringRange, numGlyphsToPreallocate);
+}
+
+TextLayout::Arena& TextLayout::getArena() const
+{
+    if (arena == nullptr)
+    {
+        const StoragePool::ScopedAccess access (true);
+        StoragePool* const pool = access.getPool();
+        arena = pool != nullptr ? pool->takeArena() : nullptr;
+
+        if (arena == nullptr)
+            arena = new Arena();
+    }
+
+    return *arena;
+}
+
+TextLayout::SharedData& TextLayout::getWritableData() const
+{
+    if (data == nullptr)
+    {
+        const StoragePool::ScopedAccess access (true);
+        StoragePool* const pool = access.getPool();
+
+        if (pool != nullptr)
+            data = pool->takeData();
+
+        if (data == nullptr)
+            data = new SharedData();
+    }
+    else if (data->getReferenceCount() > 1)
+    {
+        const SharedData::Ptr newData (new SharedData());
+        newData->copyFrom (*data);
+        data = newData;
+    }
+
+    return *data;
+}
+
+void TextLayout::clearLines()
+{
+    shapedText = nullptr;
+
+    if (data == nullptr)
+        return;
+
+    if (data->getReferenceCount() > 1)
+    {
+        // another layout is still using this data, so just let go of it
+        data = nullptr;
+        return;
+    }
+
+    Arena& a = getArena();
+    a.recycle (data->lines);
+
+    if (data->glyphStore != nullptr)
+    {
+        data->glyphStore->clear();
+
+        if (a.spareGlyphStore == nullptr)
+            a.spareGlyphStore = data->glyphStore.release();
+        else
+            data->glyphStore = nullptr;
+    }
+}
+
+void TextLayout::setStorageMode (const StorageMode newMode)
+{
+    if (storageMode != newMode)
+    {
+        storageMode = newMode;
+
+        expandLines();
+
+        if (newMode != objectStorage)
+            flattenLines();
+    }
+}
+
+void TextLayout::flattenLines()
+{
+    SharedData& d = getWritableData();
+    Arena& a = getArena();
+
+    if (d.glyphStore == nullptr)
+        d.glyphStore = a.spareGlyphStore != nullptr ? a.spareGlyphStore.release()
+                                                    : new GlyphStore();
+
+    d.glyphStore->setLines (d.lines, storageMode == compactStorage);
+    a.recycle (d.lines);
+}
+
+void TextLayout::expandLines() const
+{
+    if (data != nullptr && data->glyphStore != nullptr)
+    {
+        SharedData& d = getWritableData();
+        jassert (d.lines.size() == 0);
+
+        Arena& a = getArena();
+        d.glyphStore->createLines (d.lines, a);
+        d.glyphStore->clear();
+        a.spareGlyphStore = d.glyphStore.release();
+    }
+}
+
+Range<float> TextLayout::getLineBoundsX (const int lineIndex) const noexcept
+{
+    return data->glyphStore != nullptr ? data->glyphStore->getLineBoundsX (lineIndex)
+                                       : data->lines.getUnchecked (lineIndex)->getLineBoundsX();
+}
+
+void TextLayout::draw (Graphics& g, const Rectangle<float>& area) const
+{
+    const Point<float> origin (justification.appliedToRectangle (Rectangle<float> (0, 0, width, getHeight()), area).getPosition());
+
+    LowLevelGraphicsContext& context = *g.getInternalContext();
+
+    if (data == nullptr)
+        return;
+
+    if (data->glyphStore != nullptr)
+    {
+        data->glyphStore->draw (context, origin);
+        return;
+    }
+
+    const OwnedArray<Line>& lines = data->lines;
+
+    for (int i = 0; i < lines.size(); ++i)
+    {
+        const Line& line = *lines.getUnchecked (i);
+        const Point<float> lineOrigin (origin + line.lineOrigin);
+
+        for (int j = 0; j < line.runs.size(); ++j)
+        {
+            const Run* const run = line.runs.getUnchecked (j);
+            jassert (run != nullptr);
+            context.setFont (run->font);
+            context.setFill (run->colour);
+
+            for (int k = 0; k < run->glyphs.size(); ++k)
+            {
+                const Glyph& glyph = run->glyphs.getReference (k);
+                context.drawGlyph (glyph.glyphCode, AffineTransform::translation (lineOrigin.x + glyph.anchor.x,
+                                                                                  lineOrigin.y + glyph.anchor.y));
+            }
+        }
+    }
+}
+
+//==============================================================================
+void TextLayout::writeToStream (OutputStream& output) const
+{
+    if (data != nullptr && data->glyphStore != nullptr)
+    {
+        data->glyphStore->writeToStream (output, width, justification);
+    }
+    else
+    {
+        GlyphStore store;
+
+        if (data != nullptr)
+            store.setLines (data->lines, storageMode == compactStorage);
+
+        store.writeToStream (output, width, justification);
+    }
+}
+
+bool TextLayout::loadFromMemory (const void* sourceData, size_t dataSize)
+{
+    clearLines();
+
+    Arena& a = getArena();
+    ScopedPointer<GlyphStore> store (a.spareGlyphStore != nullptr ? a.spareGlyphStore.release()
+                                                                  : new GlyphStore());
+
+    if (! store->loadFromMemory (sourceData, dataSize, width, justification))
+    {
+        a.spareGlyphStore = store.release();
+        return false;
+    }
+
+    storageMode = store->isUsingCompactFormat() ? compactStorage : flatStorage;
+    getWritableData().glyphStore = store.release();
+    return true;
+}
+
+bool TextLayout::loadFromFile (const File& file)
+{
+    ScopedPointer<MemoryMappedFile> mappedFile (new MemoryMappedFile (file, MemoryMappedFile::readOnly));
+
+    if (mappedFile->getData() == nullptr
+         || ! loadFromMemory (mappedFile->getData(), mappedFile->getSize()))
+        return false;
+
+    data->glyphStore->mappedFile = mappedFile.release();
+    return true;
+}
+
+void TextLayout::createLayout (const AttributedString& text, float maxWidth)
+{
+    if (updateShapedLayout (text, maxWidth, false))
+        return;
+
+    clearLines();
+    width = maxWidth;
+    justification = text.getJustification();
+
+    const bool isNativeLayout = createNativeLayout (text);
+
+    if (! isNativeLayout)
+    {
+        createStandardLayout (text, false);
+        shapedText->pimpl->isFallbackForNativeLayout = true;
+    }
+
+    finishLayout (text, isNativeLayout);
+}
+
+void TextLayout::createLayoutWithOptimalLineBreaks (const AttributedString& text, float maxWidth)
+{
+    if (updateShapedLayout (text, maxWidth, true))
+        return;
+
+    clearLines();
+    width = maxWidth;
+    justification = text.getJustification();
+
+    createStandardLayout (text, true);
+
+    finishLayout (text, false);
+}
+
+void TextLayout::finishLayout (const AttributedString& text, const bool isNativeLayout)
+{
+    cacheLineBounds();
+    recalculateWidth (text, isNativeLayout);
+
+    if (storageMode != objectStorage)
+        flattenLines();
+}
+
+//==============================================================================
+namespace TextLayoutHelpers
+{
+    /*  The glyph and advance of each printable character among the first 256 code points,
+        for one font at one size, so that text made only of those characters can be measured
+        without calling the shaper at all.
+
+        That's only right for a font which never kerns pairs of these characters or joins them
+        into ligatures, so the table is checked when it's built. The characters are shaped as a
+        de Bruijn sequence, which contains every ordered pair of them exactly once, and each
+        character must come out as the same glyph with the same advance whatever follows it.
+        If anything differs, or the font has any extra kerning, the table is marked as unusable.
+    */
+    class AdvanceTable  : public ReferenceCountedObject
+    {
+    public:
+        AdvanceTable (const Font& font)  : usable (false)
+        {
+            for (int i = 0; i < numElementsInArray (glyphs); ++i)
+            {
+                glyphs[i] = -1;
+                advances[i] = 0;
+            }
+
+            if (font.getExtraKerningFactor() != 0)
+                return;
+
+            Array<juce_wchar> sequence;
+            createPairSequence (sequence);
+
+            // (the sequence is shaped in pieces which overlap by one character, so that no pair
+            // gets split up, and the offsets never get large enough to lose any precision)
+            const int chunkSize = 1024;
+            const float tolerance = font.getHeight() * 0.001f;
+            Array<int> shapedGlyphs;
+            Array<float> shapedOffsets;
+
+            for (int start = 0; start < sequence.size() - 1; start += chunkSize)
+            {
+                const int num = jmin (chunkSize + 1, sequence.size() - start);
+
+                shapedGlyphs.clearQuick();
+                shapedOffsets.clearQuick();
+                font.getGlyphPositions (String (CharPointer_UTF32 (sequence.getRawDataPointer() + start), (size_t) num),
+                                        shapedGlyphs, shapedOffsets);
+
+                if (shapedGlyphs.size() != num || shapedOffsets.size() != num + 1)
+                    return;
+
+                for (int i = 0; i < num; ++i)
+                {
+                    const juce_wchar c = sequence.getUnchecked (start + i);
+                    const int glyph = shapedGlyphs.getUnchecked (i);
+                    const float advance = shapedOffsets.getUnchecked (i + 1) - shapedOffsets.getUnchecked (i);
+
+                    if (glyphs[c] < 0)
+                    {
+                        glyphs[c] = glyph;
+                        advances[c] = advance;
+                    }
+                    else if (glyph != glyphs[c] || std::abs (advance - advances[c]) > tolerance)
+                    {
+                        return;
+                    }
+                }
+            }
+
+            usable = true;
+        }
+
+        bool isUsable() const noexcept      { return usable; }
+
+        /** Appends the glyphs and x offsets for the characters between start and end, in the
+            same form as Font::getGlyphPositions(). If any of the characters aren't in the table,
+            this returns false, and the arrays may have been left partly filled in.
+        */
+        bool getGlyphPositions (String::CharPointerType start, const String::CharPointerType& end,
+                                Array<int>& glyphNumbers, Array<float>& xOffsets) const
+        {
+            jassert (glyphNumbers.size() == 0 && xOffsets.size() == 0);
+            xOffsets.add (0.0f);
+
+            while (start != end)
+            {
+                const uint32 c = (uint32) start.getAndAdvance();
+
+                if (c >= 256 || glyphs[c] < 0)
+                    return false;
+
+                glyphNumbers.add (glyphs[c]);
+                xOffsets.add (advances[c]);
+            }
+
+            // (the advances are now turned into offsets, by a running total)
+            float* const x = xOffsets.getRawDataPointer() + 1;
+            const int num = glyphNumbers.size();
+            float total = 0;
+            int i = 0;
+
+           #if JUCE_TEXTLAYOUT_USE_SSE2
+            __m128 carry = _mm_setzero_ps();
+
+            for (; i + 4 <= num; i += 4)
+            {
+                __m128 v = _mm_loadu_ps (x + i);
+                v = _mm_add_ps (v, _mm_castsi128_ps (_mm_slli_si128 (_mm_castps_si128 (v), 4)));
+                v = _mm_add_ps (v, _mm_castsi128_ps (_mm_slli_si128 (_mm_castps_si128 (v), 8)));
+                v = _mm_add_ps (v, carry);
+                _mm_storeu_ps (x + i, v);
+                carry = _mm_shuffle_ps (v, v, _MM_SHUFFLE (3, 3, 3, 3));
+            }
+
+            if (i > 0)
+                total = x[i - 1];
+           #endif
+
+            for (; i < num; ++i)
+                x[i] = (total += x[i]);
+
+            return true;
+        }
+
+        typedef ReferenceCountedObjectPtr<AdvanceTable> Ptr;
+
+    private:
+        int glyphs [256];
+        float advances [256];
+        bool usable;
+
+        /*  Every printable character below 256, arranged so that each ordered pair of them
+            appears exactly once: this is the Lyndon words (a) and (a, b) with a < b, in order,
+            followed by the first character again to close the cycle.
+        */
+        static void createPairSequence (Array<juce_wchar>& sequence)
+        {
+            Array<juce_wchar> chars;
+
+            for (juce_wchar c = ' '; c < 0x100; ++c)
+                if (c < 0x7f || c >= 0xa0)
+                    chars.add (c);
+
+            const int num = chars.size();
+            sequence.ensureStorageAllocated (num * num + 1);
+
+            for (int a = 0; a < num; ++a)
+            {
+                sequence.add (chars.getUnchecked (a));
+
+                for (int b = a + 1; b < num; ++b)
+                {
+                    sequence.add (chars.getUnchecked (a));
+                    sequence.add (chars.getUnchecked (b));
+                }
+            }
+
+            sequence.add (chars.getUnchecked (0));
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (AdvanceTable);
+    };
+
+    //==============================================================================
+    /*  A least-recently-used cache of shaped words, shared by every standard layout.
+
+        Each entry maps a font and a string of text to the glyph numbers and x offsets
+        that Font::getGlyphPositions() returned for them. The entries are kept in a
+        list with the most recently used at the front. When the cache's memory budget
+        is exceeded, entries are dropped from the back.
+    */
+    class WordCache  : public DeletedAtShutdown
+    {
+    public:
+        WordCache() noexcept
+            : mostRecent (nullptr), leastRecent (nullptr),
+              bytesUsed (0), maxBytes (1024 * 1024), hits (0), misses (0)
+        {}
+
+        /*  The cache is deleted along with the other DeletedAtShutdown objects, in the same way
+            as the layouts' storage pools: once it has gone, there's no cache until JUCE has been
+            initialised again, and it waits for any other threads to finish with it first.
+        */
+        ~WordCache()
+        {
+            {
+                const SpinLock::ScopedLockType sl (instanceLock);
+                instance = nullptr;
+                hasBeenDeleted = true;
+                messageManagerAtShutdown = MessageManager::getInstanceWithoutCreating();
+            }
+
+            while (numUsers.get() > 0)
+                Thread::yield();
+
+            clear();
+        }
+
+        /*  Gives access to the shared cache, if there is one, and stops it from being deleted
+            at shutdown until it goes out of scope.
+        */
+        class ScopedAccess
+        {
+        public:
+            ScopedAccess()  : cache (acquire()) {}
+            ~ScopedAccess()                         { if (cache != nullptr) --(cache->numUsers); }
+
+            WordCache* get() const noexcept         { return cache; }
+
+        private:
+            WordCache* const cache;
+
+            JUCE_DECLARE_NON_COPYABLE (ScopedAccess);
+        };
+
+        /** Returns a string that identifies everything about a font that affects its shaping. */
+        static String getFontKey (const Font& font)
+        {
+            const String name (font.getTypefaceName());
+            const String style (font.getTypefaceStyle());
+
+            return String (name.length()) + ":" + name
+                    + String (style.length()) + ":" + style
+                    + String (font.getHeight()) + ";"
+                    + String (font.getHorizontalScale()) + ";"
+                    + String (font.getExtraKerningFactor()) + ";";
+        }
+
+        void getGlyphPositions (const Font& font, const String& fontKey, const String& text,
+                                Array<int>& glyphs, Array<float>& xOffsets)
+        {
+            const String key (fontKey + text);
+
+            {
+                const ScopedLock sl (lock);
+
+                if (maxBytes > 0)
+                {
+                    Entry* const e = entries [key];
+
+                    if (e != nullptr)
+                    {
+                        ++hits;
+                        moveToFront (e);
+                        glyphs.addArray (e->glyphs);
+                        xOffsets.addArray (e->xOffsets);
+                        return;
+                    }
+                }
+
+                ++misses;
+            }
+
+            // Shaping happens outside the lock, so other threads aren't held up by it.
+            const int firstGlyph = glyphs.size();
+            const int firstOffset = xOffsets.size();
+            font.getGlyphPositions (text, glyphs, xOffsets);
+
+            const ScopedLock sl (lock);
+
+            if (maxBytes == 0 || entries.contains (key))
+                return;
+
+            Entry* const e = new Entry (key);
+            e->glyphs.addArray (glyphs, firstGlyph);
+            e->xOffsets.addArray (xOffsets, firstOffset);
+            e->numBytes = sizeof (Entry) + key.getNumBytesAsUTF8()
+                            + (size_t) e->glyphs.size() * sizeof (int)
+                            + (size_t) e->xOffsets.size() * sizeof (float);
+
+            entries.set (key, e);
+            bytesUsed += e->numBytes;
+            moveToFront (e);
+            trim();
+        }
+
+        /** Returns the table of advances for a font, building it if it hasn't been used before,
+            or nullptr if the font isn't suitable for using one.
+        */
+        /*  Returns the font's table of advances if it has a usable one. A table is only built once
+            the font has been asked for a few times, unless the caller knows that it's worth building
+            one straight away.
+        */
+        AdvanceTable::Ptr getAdvanceTable (const Font& font, const String& fontKey, const bool buildImmediately = false)
+        {
+            {
+                const ScopedLock sl (lock);
+
+                if (advanceTables.contains (fontKey))
+                {
+                    AdvanceTable::Ptr table (advanceTables [fontKey]);
+                    return table->isUsable() ? table : AdvanceTable::Ptr();
+                }
+
+                // (building a table means shaping tens of thousands of characters, so it's only
+                // worth doing for a font that keeps turning up in new layouts)
+                const int numRequests = advanceTableRequests [fontKey] + 1;
+
+                if (numRequests < minRequestsForAdvanceTable && ! buildImmediately)
+                {
+                    if (advanceTableRequests.size() >= maxAdvanceTableRequests)
+                        advanceTableRequests.clear();
+
+                    advanceTableRequests.set (fontKey, numRequests);
+                    return AdvanceTable::Ptr();
+                }
+
+                advanceTableRequests.remove (fontKey);
+            }
+
+            // (like shaping, building a table happens outside the lock)
+            AdvanceTable::Ptr table (new AdvanceTable (font));
+
+            const ScopedLock sl (lock);
+
+            // (there's no need for anything cleverer than starting again if lots of fonts get used)
+            if (advanceTables.size() >= maxAdvanceTables)
+                advanceTables.clear();
+
+            advanceTables.set (fontKey, table);
+            return table->isUsable() ? table : AdvanceTable::Ptr();
+        }
+
+        void setMaxBytes (const size_t newMaxBytes)
+        {
+            const ScopedLock sl (lock);
+            maxBytes = newMaxBytes;
+            trim();
+        }
+
+        void clear()
+        {
+            const ScopedLock sl (lock);
+
+            while (leastRecent != nullptr)
+                removeEntry (leastRecent);
+
+            advanceTables.clear();
+            advanceTableRequests.clear();
+            hits = misses = 0;
+        }
+
+        TextLayout::WordCacheStats getStats() const
+        {
+            const ScopedLock sl (lock);
+
+            TextLayout::WordCacheStats stats;
+            stats.hits = hits;
+            stats.misses = misses;
+            stats.numEntries = entries.size();
+            stats.bytesUsed = bytesUsed;
+            stats.maxBytes = maxBytes;
+            return stats;
+        }
+
+    private:
+        struct Entry
+        {
+            Entry (const String& key_) : key (key_), numBytes (0), previous (nullptr), next (nullptr) {}
+
+            const String key;
+            Array<int> glyphs;
+            Array<float> xOffsets;
+            size_t numBytes;
+            Entry* previous;
+            Entry* next;
+
+            JUCE_DECLARE_NON_COPYABLE (Entry);
+        };
+
+        static WordCache* acquire()
+        {
+            const SpinLock::ScopedLockType sl (instanceLock);
+
+            if (hasBeenDeleted)
+            {
+                MessageManager* const mm = MessageManager::getInstanceWithoutCreating();
+                hasBeenDeleted = (mm == nullptr || mm == messageManagerAtShutdown);
+            }
+
+            if (instance == nullptr && ! hasBeenDeleted)
+                instance = new WordCache();
+
+            if (instance != nullptr)
+                ++(instance->numUsers);
+
+            return instance;
+        }
+
+        enum { maxAdvanceTables = 64, maxAdvanceTableRequests = 1024, minRequestsForAdvanceTable = 3 };
+
+        CriticalSection lock;
+        HashMap<String, Entry*> entries;
+        HashMap<String, AdvanceTable::Ptr> advanceTables;
+        HashMap<String, int> advanceTableRequests;      // the fonts that don't have a table yet
+        Entry* mostRecent;
+        Entry* leastRecent;
+        size_t bytesUsed, maxBytes;
+        int64 hits, misses;
+        Atomic<int> numUsers;
+
+        static SpinLock instanceLock;
+        static WordCache* instance;
+        static bool hasBeenDeleted;
+        static const void* messageManagerAtShutdown;
+
+        void unlink (Entry* const e) noexcept
+        {
+            if (e->previous != nullptr)  e->previous->next = e->next;
+            else if (mostRecent == e)    mostRecent = e->next;
+
+            if (e->next != nullptr)      e->next->previous = e->previous;
+            else if (leastRecent == e)   leastRecent = e->previous;
+
+            e->previous = e->next = nullptr;
+        }
+
+        void moveToFront (Entry* const e) noexcept
+        {
+            if (mostRecent == e)
+                return;
+
+            unlink (e);
+            e->next = mostRecent;
+
+            if (mostRecent != nullptr)
+                mostRecent->previous = e;
+
+            mostRecent = e;
+
+            if (leastRecent == nullptr)
+                leastRecent = e;
+        }
+
+        void removeEntry (Entry* const e)
+        {
+            unlink (e);
+            entries.remove (e->key);
+            bytesUsed -= e->numBytes;
+            delete e;
+        }
+
+        void trim()
+        {
+            while (bytesUsed > maxBytes && leastRecent != nullptr)
+                removeEntry (leastRecent);
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (WordCache);
+    };
+
+    SpinLock WordCache::instanceLock;
+    WordCache* WordCache::instance = nullptr;
+    bool WordCache::hasBeenDeleted = false;
+    const void* WordCache::messageManagerAtShutdown = nullptr;
+}
+
+void TextLayout::setWordCacheSize (const size_t maxBytes)
+{
+    const TextLayoutHelpers::WordCache::ScopedAccess access;
+    TextLayoutHelpers::WordCache* const cache = access.get();
+
+    if (cache != nullptr)
+        cache->setMaxBytes (maxBytes);
+}
+
+void TextLayout::clearWordCache()
+{
+    const TextLayoutHelpers::WordCache::ScopedAccess access;
+    TextLayoutHelpers::WordCache* const cache = access.get();
+
+    if (cache != nullptr)
+        cache->clear();
+}
+
+TextLayout::WordCacheStats TextLayout::getWordCacheStats()
+{
+    const TextLayoutHelpers::WordCache::ScopedAccess access;
+    TextLayoutHelpers::WordCache* const cache = access.get();
+
+    if (cache != nullptr)
+        return cache->getStats();
+
+    return WordCacheStats();
+}
+
+//==============================================================================
+#include "juce_TextLayoutUnicodeData.h"
+
+namespace TextLayoutHelpers
+{
+    struct FontAndColour
+    {
+        FontAndColour (const int fontIndex_) noexcept   : fontIndex (fontIndex_), colour (0xff000000) {}
+
+        int fontIndex;
+        Colour colour;
+
+        bool operator!= (const FontAndColour& other) const noexcept
+        {
+            return fontIndex != other.fontIndex || colour != other.colour;
+        }
+    };
+
+    struct RunAttribute
+    {
+        RunAttribute (const FontAndColour& fontAndColour_, const Range<int>& range_) noexcept
+            : fontAndColour (fontAndColour_), range (range_)
+        {}
+
+        FontAndColour fontAndColour;
+        Range<int> range;
+    };
+
+    struct Token
+    {
+        Token (const Range<int>& range_, const int fontIndex_, const Colour& c, const int width, const int height,
+               const int firstGlyph_, const int numGlyphs_, const bool isWhitespace_, const bool isNewLine_,
+               const bool canBreakBefore_, const uint8 bidiLevel_, const uint8 paragraphLevel_)
+            : range (range_), fontIndex (fontIndex_), colour (c),
+              area (width, height), line (0), lineHeight (0),
+              firstGlyph (firstGlyph_), numGlyphs (numGlyphs_),
+              isWhitespace (isWhitespace_), isNewLine (isNewLine_), canBreakBefore (canBreakBefore_),
+              bidiLevel (bidiLevel_), paragraphLevel (paragraphLevel_), isShaped (false)
+        {}
+
+        Range<int> range;                               // the token's character range, from the start of its paragraph
+        int fontIndex;
+        Colour colour;
+        Rectangle<int> area;
+        int line, lineHeight;                           // (the line is counted from the start of the paragraph)
+        int firstGlyph, numGlyphs;                      // the token's glyphs in its paragraph's glyph arrays
+        bool isWhitespace, isNewLine;
+        bool canBreakBefore;                            // true if a line may start with this token
+        uint8 bidiLevel, paragraphLevel;                // the embedding levels of the token and its paragraph
+        bool isShaped;                                  // false until the token's glyphs have been added
+    };
+
+    //==============================================================================
+    /*  The character types used by the Unicode Bidirectional Algorithm, in the same order
+        as the class numbers in the tables in juce_TextLayoutUnicodeData.h.
+    */
+    enum BidiClass
+    {
+        bidiL = 0, bidiR, bidiAL, bidiEN, bidiES, bidiET, bidiAN, bidiCS, bidiNSM, bidiBN,
+        bidiB, bidiS, bidiWS, bidiON, bidiLRE, bidiLRO, bidiRLE, bidiRLO, bidiPDF,
+        bidiLRI, bidiRLI, bidiFSI, bidiPDI
+    };
+
+    static uint8 getBidiClass (const juce_wchar c) noexcept
+    {
+        using namespace TextLayoutUnicodeData;
+
+        if (((uint32) c) < 256)
+            return latin1BidiClasses [c];
+
+        const uint32 key = (jmin ((uint32) c, (uint32) 0x10ffff) << 8) | 0xff;
+        const uint32* const end = bidiClassRanges + numElementsInArray (bidiClassRanges);
+        return (uint8) (std::upper_bound (bidiClassRanges, end, key)[-1] & 0xff);
+    }
+
+    // Returns true for the classes that can make a paragraph anything other than
+    // entirely left-to-right: the strong right-to-left types, Arabic numbers, and
+    // the explicit embedding, override and isolate controls.
+    static bool canBeRightToLeft (const uint8 bidiClass) noexcept
+    {
+        const uint32 rightToLeftClasses = (1 << bidiR) | (1 << bidiAL) | (1 << bidiAN)
+                                           | (1 << bidiLRE) | (1 << bidiLRO) | (1 << bidiRLE) | (1 << bidiRLO)
+                                           | (1 << bidiPDF) | (1 << bidiLRI) | (1 << bidiRLI) | (1 << bidiFSI)
+                                           | (1 << bidiPDI);
+
+        return (rightToLeftClasses & (1u << bidiClass)) != 0;
+    }
+
+    /*  Checks whether any of the given characters could need the bidi algorithm.
+
+        No ASCII character can, so the UTF-8 data is skipped over 16 bytes at a time with SSE2
+        (or 8 at a time in a 64-bit word, where SSE2 isn't being used) until a byte with its top
+        bit set turns up. Only those characters are decoded and looked up in the class table.
+    */
+    static bool containsRightToLeftText (String::CharPointerType text, int numChars) noexcept
+    {
+       #if JUCE_STRING_UTF_TYPE == 8
+        const char* p = text.getAddress();
+
+        while (numChars > 0)
+        {
+           #if JUCE_TEXTLAYOUT_USE_SSE2
+            // (16 characters must take up at least 16 bytes, so these reads can't go past the end)
+            while (numChars >= 16 && _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i*) p)) == 0)
+            {
+                p += 16;
+                numChars -= 16;
+            }
+           #endif
+
+            while (numChars >= 8)
+            {
+                uint64 bytes;
+                memcpy (&bytes, p, sizeof (bytes));
+
+                if ((bytes & literal64bit (0x8080808080808080)) != 0)
+                    break;
+
+                p += 8;
+                numChars -= 8;
+            }
+
+            if (numChars == 0)
+                break;
+
+            CharPointer_UTF8 charPointer (p);
+            const juce_wchar c = charPointer.getAndAdvance();
+            p = charPointer.getAddress();
+            --numChars;
+
+            if (c >= 0x80 && canBeRightToLeft (getBidiClass (c)))
+                return true;
+        }
+       #else
+        while (--numChars >= 0)
+            if (canBeRightToLeft (getBidiClass (text.getAndAdvance())))
+                return true;
+       #endif
+
+        return false;
+    }
+
+    /*  Finds the embedding level of each character in some paragraphs of text, using the
+        Unicode Bidirectional Algorithm (UAX #9), up to and including rule L1 for the ends
+        of the paragraphs. The reordering of each line (L2) is left to the TokenParagraph, as it
+        can only be done once the lines are known.
+
+        The algorithm is followed in full, apart from the pairing of brackets (N0), which
+        would need another table: neutral brackets are resolved like any other neutral.
+        All the working space is kept in arrays which are allocated once for the whole text.
+    */
+    class BidiLevels
+    {
+    public:
+        BidiLevels() noexcept  : firstIndex (0), hasIsolates (false), allLeftToRight (true) {}
+
+        /** Resolves the levels of numChars characters of text, which must be made up of
+            whole paragraphs. The first character's index in the whole string is given, so
+            that the levels can then be looked up using indexes into the whole string.
+        */
+        void resolve (String::CharPointerType text, const int firstCharIndex, const int numChars,
+                      const AttributedString::ReadingDirection direction)
+        {
+            firstIndex = firstCharIndex;
+            classes.clearQuick();
+            paragraphs.clearQuick();
+            hasIsolates = false;
+            allLeftToRight = true;
+
+            // Most text has no right-to-left characters at all, and then every level is 0..
+            if (direction != AttributedString::rightToLeft && ! containsRightToLeftText (text, numChars))
+            {
+                addParagraph (numChars);
+                return;
+            }
+
+            classes.ensureStorageAllocated (numChars);
+
+            juce_wchar lastChar = 0;
+
+            for (int i = 0; i < numChars; ++i)
+            {
+                const juce_wchar c = text.getAndAdvance();
+                const uint8 type = getBidiClass (c);
+
+                // (a paragraph ends after each separator, with a CR-LF pair counting as one)
+                if (i > 0 && classes.getUnchecked (i - 1) == bidiB && ! (lastChar == '\r' && c == '\n'))
+                    addParagraph (i);
+
+                hasIsolates = hasIsolates || (type >= bidiLRI);
+                classes.add (type);
+                lastChar = c;
+            }
+
+            addParagraph (numChars);
+
+            types.clearQuick();
+            types.addArray (classes);
+            levels.clearQuick();
+            levels.insertMultiple (0, 0, numChars);
+
+            if (hasIsolates)
+            {
+                isolatePartners.clearQuick();
+                isolatePartners.insertMultiple (0, -1, numChars);
+            }
+
+            int start = 0;
+
+            for (int i = 0; i < paragraphs.size(); ++i)
+            {
+                Paragraph& p = paragraphs.getReference (i);
+                p.level = findParagraphLevel (start, p.end, direction);
+                resolveParagraph (start, p.end, p.level);
+                start = p.end;
+            }
+        }
+
+        /** Returns true if every character was found to be at level 0. */
+        bool isAllLeftToRight() const noexcept      { return allLeftToRight; }
+
+        /** Returns the resolved level of a character. */
+        uint8 getLevel (const int index) const noexcept
+        {
+            return allLeftToRight ? 0 : levels.getUnchecked (index - firstIndex);
+        }
+
+        /** Returns the level of the paragraph that contains a character. */
+        uint8 getParagraphLevel (const int index) const noexcept
+        {
+            if (allLeftToRight)
+                return 0;
+
+            int start = 0, end = paragraphs.size() - 1;
+
+            while (start < end)
+            {
+                const int mid = (start + end) / 2;
+
+                if (paragraphs.getReference (mid).end <= index - firstIndex)
+                    start = mid + 1;
+                else
+                    end = mid;
+            }
+
+            return paragraphs.getReference (start).level;
+        }
+
+    private:
+        struct Paragraph
+        {
+            int end;
+            uint8 level;
+        };
+
+        enum { maxDepth = 125 };
+
+        Array<uint8> classes, types, levels;
+        Array<Paragraph> paragraphs;
+        Array<int> isolatePartners, sequence;
+        Array<Range<int> > levelRuns;
+        Array<bool> isRunLinked;
+        int firstIndex;
+        bool hasIsolates, allLeftToRight;
+
+        void addParagraph (const int end)
+        {
+            const Paragraph p = { end, 0 };
+            paragraphs.add (p);
+        }
+
+        static bool isRemovedByX9 (const uint8 type) noexcept
+        {
+            return type == bidiBN;
+        }
+
+        static bool isIsolateInitiator (const uint8 type) noexcept
+        {
+            return type == bidiLRI || type == bidiRLI || type == bidiFSI;
+        }
+
+        static bool isNeutralOrIsolate (const uint8 type) noexcept
+        {
+            return type == bidiB || type == bidiS || type == bidiWS || type == bidiON || type >= bidiLRI;
+        }
+
+        int getIsolatePartner (const int index) const noexcept
+        {
+            return hasIsolates ? isolatePartners.getUnchecked (index) : -1;
+        }
+
+        // P2 and P3: returns 0 if the first strong character is L, 1 if it's R or AL, or -1 if
+        // there isn't one. Anything between an isolate initiator and its PDI is skipped.
+        int findFirstStrongDirection (const int start, const int end) const noexcept
+        {
+            int isolateDepth = 0;
+
+            for (int i = start; i < end; ++i)
+            {
+                switch (classes.getUnchecked (i))
+                {
+                    case bidiL:     if (isolateDepth == 0) return 0; break;
+                    case bidiR:
+                    case bidiAL:    if (isolateDepth == 0) return 1; break;
+                    case bidiLRI:
+                    case bidiRLI:
+                    case bidiFSI:   ++isolateDepth; break;
+                    case bidiPDI:   if (isolateDepth > 0) --isolateDepth; break;
+                    default:        break;
+                }
+            }
+
+            return -1;
+        }
+
+        uint8 findParagraphLevel (const int start, const int end,
+                                  const AttributedString::ReadingDirection direction) const noexcept
+        {
+            if (direction == AttributedString::rightToLeft)    return 1;
+            if (direction == AttributedString::leftToRight)    return 0;
+
+            return findFirstStrongDirection (start, end) == 1 ? 1 : 0;
+        }
+
+        void resolveParagraph (const int start, const int end, const uint8 paragraphLevel)
+        {
+            // Text with nothing that could make it right-to-left doesn't need resolving at all..
+            bool needsResolving = paragraphLevel != 0;
+
+            for (int i = start; i < end && ! needsResolving; ++i)
+                needsResolving = canBeRightToLeft (classes.getUnchecked (i));
+
+            if (! needsResolving)
+                return;
+
+            allLeftToRight = false;
+
+            if (hasIsolates)
+                findIsolatePartners (start, end);
+
+            applyExplicitLevels (start, end, paragraphLevel);
+            findLevelRuns (start, end);
+
+            isRunLinked.clearQuick();
+            isRunLinked.insertMultiple (0, false, levelRuns.size());
+
+            for (int i = 0; i < levelRuns.size(); ++i)
+                if (! isRunLinked.getUnchecked (i))
+                    resolveIsolatingRunSequence (i, start, end, paragraphLevel);
+
+            uint8* const l = levels.getRawDataPointer();
+            const uint8* const t = types.getRawDataPointer();
+
+            // I1 and I2 (these can only be done once all the sequences have been resolved, as
+            // each sequence needs the embedding levels of the characters around it), and then
+            // the characters that X9 removed take the level of the one before them..
+            for (int i = start; i < end; ++i)
+            {
+                const uint8 type = t[i];
+
+                if (isRemovedByX9 (type))
+                    l[i] = (i > start) ? l[i - 1] : paragraphLevel;
+                else if ((l[i] & 1) == 0)
+                    l[i] = (uint8) (l[i] + (type == bidiR ? 1 : ((type == bidiAN || type == bidiEN) ? 2 : 0)));
+                else if (type != bidiR)
+                    l[i] = (uint8) (l[i] + 1);
+            }
+
+            // L1: separators, and any whitespace before them or at the end of the paragraph,
+            // go back to the paragraph level.
+            bool isTrailing = true;
+
+            for (int i = end; --i >= start;)
+            {
+                const uint8 c = classes.getUnchecked (i);
+
+                if (c == bidiB || c == bidiS)
+                {
+                    l[i] = paragraphLevel;
+                    isTrailing = true;
+                }
+                else if (isTrailing && (c == bidiWS || c == bidiBN || c >= bidiLRE))
+                {
+                    l[i] = paragraphLevel;
+                }
+                else
+                {
+                    isTrailing = false;
+                }
+            }
+        }
+
+        // BD9: matches each isolate initiator with its PDI.
+        void findIsolatePartners (const int start, const int end)
+        {
+            Array<int>& openIsolates = sequence;
+            openIsolates.clearQuick();
+
+            for (int i = start; i < end; ++i)
+            {
+                const uint8 c = classes.getUnchecked (i);
+
+                if (isIsolateInitiator (c))
+                {
+                    openIsolates.add (i);
+                }
+                else if (c == bidiPDI && openIsolates.size() > 0)
+                {
+                    const int initiator = openIsolates.removeAndReturn (openIsolates.size() - 1);
+                    isolatePartners.set (initiator, i);
+                    isolatePartners.set (i, initiator);
+                }
+            }
+        }
+
+        // X1 to X9: applies the explicit embeddings, overrides and isolates.
+        void applyExplicitLevels (const int start, const int end, const uint8 paragraphLevel) noexcept
+        {
+            struct Status
+            {
+                uint8 level, override;
+                bool isIsolate;
+            };
+
+            Status stack [maxDepth + 2];
+            int depth = 0;
+            stack[0].level = paragraphLevel;
+            stack[0].override = bidiON;
+            stack[0].isIsolate = false;
+
+            int overflowIsolates = 0, overflowEmbeddings = 0, validIsolates = 0;
+            uint8* const l = levels.getRawDataPointer();
+            uint8* const t = types.getRawDataPointer();
+
+            for (int i = start; i < end; ++i)
+            {
+                const uint8 type = t[i];
+
+                switch (type)
+                {
+                    case bidiRLE:
+                    case bidiLRE:
+                    case bidiRLO:
+                    case bidiLRO:
+                    {
+                        const uint8 level = stack[depth].level;
+                        const uint8 newLevel = (type == bidiRLE || type == bidiRLO) ? (uint8) ((level + 1) | 1)
+                                                                                    : (uint8) ((level + 2) & ~1);
+
+                        if (newLevel <= maxDepth && overflowIsolates == 0 && overflowEmbeddings == 0)
+                        {
+                            ++depth;
+                            stack[depth].level = newLevel;
+                            stack[depth].override = (uint8) (type == bidiRLO ? bidiR : (type == bidiLRO ? bidiL : bidiON));
+                            stack[depth].isIsolate = false;
+                        }
+                        else if (overflowIsolates == 0)
+                        {
+                            ++overflowEmbeddings;
+                        }
+
+                        t[i] = bidiBN;
+                        break;
+                    }
+
+                    case bidiRLI:
+                    case bidiLRI:
+                    case bidiFSI:
+                    {
+                        const uint8 level = stack[depth].level;
+                        l[i] = level;
+
+                        if (stack[depth].override != bidiON)
+                            t[i] = stack[depth].override;
+
+                        bool isRightToLeft = (type == bidiRLI);
+
+                        if (type == bidiFSI)
+                        {
+                            const int partner = getIsolatePartner (i);
+                            isRightToLeft = findFirstStrongDirection (i + 1, partner >= 0 ? partner : end) == 1;
+                        }
+
+                        const uint8 newLevel = isRightToLeft ? (uint8) ((level + 1) | 1)
+                                                             : (uint8) ((level + 2) & ~1);
+
+                        if (newLevel <= maxDepth && overflowIsolates == 0 && overflowEmbeddings == 0)
+                        {
+                            ++validIsolates;
+                            ++depth;
+                            stack[depth].level = newLevel;
+                            stack[depth].override = bidiON;
+                            stack[depth].isIsolate = true;
+                        }
+                        else
+                        {
+                            ++overflowIsolates;
+                        }
+
+                        break;
+                    }
+
+                    case bidiPDI:
+                        if (overflowIsolates > 0)
+                        {
+                            --overflowIsolates;
+                        }
+                        else if (validIsolates > 0)
+                        {
+                            overflowEmbeddings = 0;
+
+                            while (! stack[depth].isIsolate)
+                                --depth;
+
+                            --depth;
+                            --validIsolates;
+                        }
+
+                        l[i] = stack[depth].level;
+
+                        if (stack[depth].override != bidiON)
+                            t[i] = stack[depth].override;
+
+                        break;
+
+                    case bidiPDF:
+                        if (overflowIsolates > 0)
+                            {}
+                        else if (overflowEmbeddings > 0)
+                            --overflowEmbeddings;
+                        else if (depth > 0 && ! stack[depth].isIsolate)
+                            --depth;
+
+                        t[i] = bidiBN;
+                        break;
+
+                    case bidiB:
+                        l[i] = paragraphLevel;
+                        break;
+
+                    case bidiBN:
+                        break;
+
+                    default:
+                        l[i] = stack[depth].level;
+
+                        if (stack[depth].override != bidiON)
+                            t[i] = stack[depth].override;
+
+                        break;
+                }
+            }
+        }
+
+        // X10: splits the paragraph into runs of characters at the same level, skipping
+        // over any that were removed by X9.
+        void findLevelRuns (const int start, const int end)
+        {
+            levelRuns.clearQuick();
+
+            const uint8* const l = levels.getRawDataPointer();
+            const uint8* const t = types.getRawDataPointer();
+            int runStart = -1, lastIndex = -1;
+
+            for (int i = start; i < end; ++i)
+            {
+                if (isRemovedByX9 (t[i]))
+                    continue;
+
+                if (runStart < 0)
+                {
+                    runStart = i;
+                }
+                else if (l[i] != l[runStart])
+                {
+                    levelRuns.add (Range<int> (runStart, lastIndex + 1));
+                    runStart = i;
+                }
+
+                lastIndex = i;
+            }
+
+            if (runStart >= 0)
+                levelRuns.add (Range<int> (runStart, lastIndex + 1));
+        }
+
+        int findLevelRunStartingAt (const int index) const noexcept
+        {
+            int start = 0, end = levelRuns.size();
+
+            while (start < end)
+            {
+                const int mid = (start + end) / 2;
+
+                if (levelRuns.getReference (mid).getStart() < index)
+                    start = mid + 1;
+                else
+                    end = mid;
+            }
+
+            return (start < levelRuns.size() && levelRuns.getReference (start).getStart() == index) ? start : -1;
+        }
+
+        // Gathers the level runs that are joined together across isolates into one sequence,
+        // and resolves the types of its characters.
+        void resolveIsolatingRunSequence (int runIndex, const int start, const int end, const uint8 paragraphLevel)
+        {
+            const uint8* const t = types.getRawDataPointer();
+            const uint8* const l = levels.getRawDataPointer();
+            sequence.clearQuick();
+
+            for (;;)
+            {
+                const Range<int> run (levelRuns.getReference (runIndex));
+
+                for (int i = run.getStart(); i < run.getEnd(); ++i)
+                    if (! isRemovedByX9 (t[i]))
+                        sequence.add (i);
+
+                const int lastChar = run.getEnd() - 1;
+
+                if (! isIsolateInitiator (classes.getUnchecked (lastChar)))
+                    break;
+
+                const int partner = getIsolatePartner (lastChar);
+                runIndex = partner >= 0 ? findLevelRunStartingAt (partner) : -1;
+
+                if (runIndex < 0)
+                    break;
+
+                isRunLinked.set (runIndex, true);
+            }
+
+            const int first = sequence.getFirst();
+            const int last = sequence.getLast();
+            const uint8 level = l[first];
+
+            int previous = first - 1;
+            while (previous >= start && isRemovedByX9 (t[previous]))
+                --previous;
+
+            int next = last + 1;
+            while (next < end && isRemovedByX9 (t[next]))
+                ++next;
+
+            const uint8 levelBefore = previous >= start ? l[previous] : paragraphLevel;
+            const uint8 levelAfter = (next < end && ! isIsolateInitiator (classes.getUnchecked (last))) ? l[next] : paragraphLevel;
+
+            resolveTypes ((uint8) ((jmax (level, levelBefore) & 1) ? bidiR : bidiL),
+                          (uint8) ((jmax (level, levelAfter)  & 1) ? bidiR : bidiL),
+                          level);
+        }
+
+        // W1 to W7, N1 and N2, for the characters in the current sequence.
+        void resolveTypes (const uint8 sos, const uint8 eos, const uint8 level) noexcept
+        {
+            const int* const s = sequence.getRawDataPointer();
+            const int n = sequence.size();
+            uint8* const t = types.getRawDataPointer();
+
+            // W1 to W3..
+            uint8 previous = sos, lastStrong = sos;
+
+            for (int k = 0; k < n; ++k)
+            {
+                uint8& type = t[s[k]];
+
+                if (type == bidiNSM)
+                    type = (isIsolateInitiator (previous) || previous == bidiPDI) ? (uint8) bidiON : previous;
+
+                previous = type;
+
+                if (type == bidiEN)
+                {
+                    if (lastStrong == bidiAL)
+                        type = bidiAN;
+                }
+                else if (type == bidiL || type == bidiR || type == bidiAL)
+                {
+                    lastStrong = type;
+
+                    if (type == bidiAL)
+                        type = bidiR;
+                }
+            }
+
+            // W4..
+            for (int k = 1; k < n - 1; ++k)
+            {
+                uint8& type = t[s[k]];
+                const uint8 before = t[s[k - 1]];
+                const uint8 after = t[s[k + 1]];
+
+                if (type == bidiES && before == bidiEN && after == bidiEN)
+                    type = bidiEN;
+                else if (type == bidiCS && before == after && (before == bidiEN || before == bidiAN))
+                    type = before;
+            }
+
+            // W5 and W6..
+            for (int k = 0; k < n;)
+            {
+                if (t[s[k]] == bidiET)
+                {
+                    int runEnd = k + 1;
+                    while (runEnd < n && t[s[runEnd]] == bidiET)
+                        ++runEnd;
+
+                    const uint8 newType = ((k > 0 && t[s[k - 1]] == bidiEN) || (runEnd < n && t[s[runEnd]] == bidiEN))
+                                            ? (uint8) bidiEN : (uint8) bidiON;
+
+                    for (; k < runEnd; ++k)
+                        t[s[k]] = newType;
+                }
+                else
+                {
+                    uint8& type = t[s[k]];
+
+                    if (type == bidiES || type == bidiCS)
+                        type = bidiON;
+
+                    ++k;
+                }
+            }
+
+            // W7..
+            lastStrong = sos;
+
+            for (int k = 0; k < n; ++k)
+            {
+                uint8& type = t[s[k]];
+
+                if (type == bidiEN)
+                {
+                    if (lastStrong == bidiL)
+                        type = bidiL;
+                }
+                else if (type == bidiL || type == bidiR)
+                {
+                    lastStrong = type;
+                }
+            }
+
+            // N1 and N2 (numbers count as R here)..
+            const uint8 embeddingDirection = (uint8) ((level & 1) ? bidiR : bidiL);
+
+            for (int k = 0; k < n;)
+            {
+                if (! isNeutralOrIsolate (t[s[k]]))
+                {
+                    ++k;
+                    continue;
+                }
+
+                int runEnd = k + 1;
+                while (runEnd < n && isNeutralOrIsolate (t[s[runEnd]]))
+                    ++runEnd;
+
+                const uint8 before = k > 0      ? (uint8) (t[s[k - 1]]  == bidiL ? bidiL : bidiR) : sos;
+                const uint8 after  = runEnd < n ? (uint8) (t[s[runEnd]] == bidiL ? bidiL : bidiR) : eos;
+                const uint8 newType = before == after ? before : embeddingDirection;
+
+                for (; k < runEnd; ++k)
+                    t[s[k]] = newType;
+            }
+
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (BidiLevels);
+    };
+
+    //==============================================================================
+    /*  The line-breaking classes of UAX #14, in the same order as the class numbers in
+        juce_TextLayoutUnicodeData.h. The pair table covers the classes up to lbCB, and the
+        rest are dealt with by LineBreakOpportunities itself.
+    */
+    enum LineBreakClass
+    {
+        lbOP = 0, lbCL, lbCP, lbQU, lbGL, lbNS, lbEX, lbSY, lbIS, lbPR, lbPO, lbNU, lbAL, lbHL, lbID, lbIN,
+        lbHY, lbBA, lbBB, lbB2, lbZW, lbCM, lbWJ, lbH2, lbH3, lbJL, lbJV, lbJT, lbRI, lbEB, lbEM, lbZWJ, lbCB,
+        lbSP, lbBK, lbCR, lbLF, lbNL
+    };
+
+    // The entries in the pair table.
+    enum LineBreakAction
+    {
+        directBreak = 0,
+        indirectBreak,              // only if there are spaces in between
+        combiningIndirectBreak,     // a combining mark, which only starts something new after spaces
+        combiningProhibitedBreak,   // a combining mark, which can't be separated even by spaces
+        prohibitedBreak
+    };
+
+    static uint8 getLineBreakClass (const juce_wchar c) noexcept
+    {
+        using namespace TextLayoutUnicodeData;
+
+        const uint32 codePoint = jmin ((uint32) c, (uint32) 0x10ffff);
+        const uint32 blockSize = 1u << lineBreakBlockShift;
+
+        return lineBreakBlocks [lineBreakBlockIndexes [codePoint >> lineBreakBlockShift] * blockSize
+                                  + (codePoint & (blockSize - 1))];
+    }
+
+    /*  Finds the places in some paragraphs of text where a line may be broken, following
+        the pair-table based implementation described in UAX #14.
+
+        Each character's class comes from a two-stage table, and each decision is then a
+        single lookup in the pair table, so there's no searching and nothing is allocated
+        apart from the list of positions that are found.
+    */
+    class LineBreakOpportunities
+    {
+    public:
+        LineBreakOpportunities() noexcept {}
+
+        /** Finds the break opportunities in numChars characters of text. The first character's
+            index in the whole string is given, so that the positions that are found are indexes
+            into the whole string.
+        */
+        void find (String::CharPointerType text, const int firstCharIndex, const int numChars)
+        {
+            using namespace TextLayoutUnicodeData;
+
+            positions.clearQuick();
+
+            if (numChars <= 0)
+                return;
+
+            uint8 current = getStartClass (getLineBreakClass (text.getAndAdvance()));
+            bool isAfterSpaces = false;
+
+            for (int i = 1; i < numChars; ++i)
+            {
+                const uint8 next = getLineBreakClass (text.getAndAdvance());
+
+                // LB4 and LB5: there's always a break after a hard line-break..
+                if (current == lbBK || (current == lbCR && next != lbLF))
+                {
+                    positions.add (firstCharIndex + i);
+                    current = getStartClass (next);
+                    isAfterSpaces = false;
+                    continue;
+                }
+
+                // LB6 and LB7: ..but never before one, or before a space.
+                if (next == lbSP)
+                {
+                    isAfterSpaces = true;
+                    continue;
+                }
+
+                if (next >= lbBK)
+                {
+                    current = (next == lbCR) ? (uint8) lbCR : (uint8) lbBK;
+                    isAfterSpaces = false;
+                    continue;
+                }
+
+                const uint8 action = lineBreakPairs [current * numLineBreakPairClasses + next];
+
+                if (action == directBreak
+                     || (isAfterSpaces && (action == indirectBreak || action == combiningIndirectBreak)))
+                    positions.add (firstCharIndex + i);
+
+                // LB9: a combining mark takes on the class of the character it's attached to..
+                if ((action == combiningIndirectBreak || action == combiningProhibitedBreak) && ! isAfterSpaces)
+                    continue;
+
+                current = next;
+                isAfterSpaces = false;
+            }
+        }
+
+        /** Returns true if a line may start at the given character. */
+        bool isOpportunityAt (const int index) const noexcept
+        {
+            const int* const p = std::lower_bound (positions.begin(), positions.end(), index);
+            return p != positions.end() && *p == index;
+        }
+
+        /** Returns the first character at or after the given index that a line may start at,
+            or the largest possible int if there aren't any more.
+        */
+        int getNextOpportunity (const int index) const noexcept
+        {
+            const int* const p = std::lower_bound (positions.begin(), positions.end(), index);
+            return p != positions.end() ? *p : std::numeric_limits<int>::max();
+        }
+
+    private:
+        Array<int> positions;
+
+        // The classes that aren't in the pair table can't be used as a row of it, so spaces at
+        // the start of a line are treated as WJ, and LF and NL as BK. (A combining mark at the
+        // start needs nothing special, as LB10's AL is what its row of the table contains).
+        static uint8 getStartClass (const uint8 lineBreakClass) noexcept
+        {
+            if (lineBreakClass == lbSP)                                 return lbWJ;
+            if (lineBreakClass == lbLF || lineBreakClass == lbNL)       return lbBK;
+            return lineBreakClass;
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (LineBreakOpportunities);
+    };
+
+    //==============================================================================
+    /*  The tokens of one paragraph, along with their glyphs and the lines that they've been
+        broken into. Everything in here is relative to the start of the paragraph: the tokens'
+        character ranges, their glyph indexes, and the lines' numbers and y positions. So when
+        an edit changes the paragraphs before this one, only its position needs to change.
+    */
+    class TokenParagraph
+    {
+    public:
+        TokenParagraph (const int charStart_, const int byteOffset_) noexcept
+            : charStart (charStart_), byteOffset (byteOffset_), firstLine (0), y (0), height (0),
+              hasBidiLevels (false)
+        {}
+
+        int getNumChars() const noexcept            { return tokens.size() > 0 ? tokens.getReference (tokens.size() - 1).range.getEnd() : 0; }
+        int getNumLines() const noexcept            { return lines.size(); }
+        bool endsWithLineBreak() const noexcept     { return tokens.size() > 0 && tokens.getReference (tokens.size() - 1).isNewLine; }
+
+        // The arrays that breaking the lines needs to work in, which are shared by all the
+        // paragraphs so that they don't each have to allocate their own.
+        struct ScratchSpace
+        {
+            Array<int> lineBreaks, visualOrder;
+            Array<uint8> lineLevels;
+        };
+
+        /** Chooses the line-breaks for the given width, and positions the tokens.
+            If the paragraph had already been laid out, this returns the number of lines at
+            its start which contain exactly the same tokens as they did before, otherwise 0.
+        */
+        int breakLines (const int maxWidth, const bool useOptimalLineBreaks, ScratchSpace& scratch)
+        {
+            Array<int>& newLineBreaks = scratch.lineBreaks;
+            newLineBreaks.clearQuick();
+
+            if (useOptimalLineBreaks)
+                findOptimalLineBreaks (maxWidth, newLineBreaks);
+            else
+                findGreedyLineBreaks (maxWidth, newLineBreaks);
+
+            int numUnchangedLines = 0;
+
+            if (lines.size() > 0)
+            {
+                if (newLineBreaks == lineBreaks)
+                {
+                    numUnchangedLines = lines.size();
+                }
+                else
+                {
+                    const int numBreaks = jmin (newLineBreaks.size(), lineBreaks.size());
+
+                    while (numUnchangedLines < numBreaks
+                            && newLineBreaks.getUnchecked (numUnchangedLines) == lineBreaks.getUnchecked (numUnchangedLines))
+                        ++numUnchangedLines;
+                }
+            }
+
+            lineBreaks.swapWith (newLineBreaks);
+            layoutRuns (scratch);
+            return numUnchangedLines;
+        }
+
+        // Fills the line with as many tokens as will fit, then moves on to the next one.
+        // Each entry added to lineBreaks is the index of a token that begins a new line.
+        // The tokens between two break opportunities can't be split up, so at each one, the
+        // decision is made for everything up to the next one.
+        void findGreedyLineBreaks (const int maxWidth, Array<int>& lineBreaks) const
+        {
+            int x = 0;
+
+            for (int i = 0; i < tokens.size() - 1; ++i)
+            {
+                const Token& t = tokens.getReference (i);
+                x += t.area.getWidth();
+
+                if (t.isNewLine
+                     || (tokens.getReference (i + 1).canBreakBefore && x + getUnbreakableWidth (i + 1) > maxWidth))
+                {
+                    lineBreaks.add (i + 1);
+                    x = 0;
+                }
+            }
+        }
+
+        // Returns the distance from the first to the last visible token in a range of tokens.
+        int getVisibleLength (const int startToken, const int endToken) const noexcept
+        {
+            int x = 0, left = -1, right = 0;
+
+            for (int i = startToken; i < endToken; ++i)
+            {
+                const Token& t = tokens.getReference (i);
+
+                if (! t.isWhitespace)
+                {
+                    if (left < 0)
+                        left = x;
+
+                    right = x + t.area.getWidth();
+                }
+
+                x += t.area.getWidth();
+            }
+
+            return left < 0 ? 0 : right - left;
+        }
+
+        /*  Adds the lines from firstLine up to (but not including) endLine to the end of the
+            layout, moved along to where the paragraph is. The token that follows the paragraph,
+            if there is one, decides how its last line ends, just as it would if all the tokens
+            were in one list.
+        */
+        void addLines (TextLayout& layout, const FontTable& fonts, const int firstLine, const int endLine,
+                       const Token* const nextParagraphStart) const
+        {
+            jassert (firstLine < endLine && endLine <= lines.size());
+
+            const int firstToken = lines.getReference (firstLine).firstToken;
+            const int endToken = endLine < lines.size() ? lines.getReference (endLine).firstToken : tokens.size();
+            int charPosition = charStart + tokens.getReference (firstToken).range.getStart();
+            int lineStartPosition = charPosition;
+            int runStartPosition = charPosition;
+
+            ScopedPointer<TextLayout::Line> currentLine;
+            ScopedPointer<TextLayout::Run> currentRun;
+
+            bool needToSetLineOrigin = true;
+
+            for (int i = firstToken; i < endToken; ++i)
+            {
+                const Token* const t = &tokens.getReference (i);
+                const Point<float> tokenPos ((float) t->area.getX(), (float) (y + t->area.getY()));
+                const Font& font = fonts [t->fontIndex];
+
+                if (currentRun == nullptr)  currentRun  = layout.createRun (Range<int>(), t->numGlyphs);
+                if (currentLine == nullptr) currentLine = layout.createLine();
+
+                currentRun->glyphs.ensureStorageAllocated (currentRun->glyphs.size() + t->numGlyphs);
+
+                // (the glyphs of a right-to-left token run from its right-hand edge)
+                const int lastGlyph = t->firstGlyph + t->numGlyphs - 1;
+                const bool isRightToLeftToken = (t->bidiLevel & 1) != 0 && t->numGlyphs > 0;
+                const float tokenWidth = isRightToLeftToken ? glyphXOffsets.getUnchecked (lastGlyph) + glyphWidths.getUnchecked (lastGlyph)
+                                                            : 0.0f;
+
+                for (int j = t->firstGlyph; j <= lastGlyph; ++j)
+                {
+                    if (needToSetLineOrigin)
+                    {
+                        needToSetLineOrigin = false;
+                        currentLine->lineOrigin = Point<float> (lines.getReference (t->line).originX,
+                                                                tokenPos.getY() + font.getAscent());
+                    }
+
+                    const float glyphWidth = glyphWidths.getUnchecked (j);
+                    float x = glyphXOffsets.getUnchecked (j);
+
+                    if (isRightToLeftToken)
+                        x = tokenWidth - x - glyphWidth;
+
+                    currentRun->glyphs.add (TextLayout::Glyph (glyphNumbers.getUnchecked (j),
+                                                               Point<float> (tokenPos.getX() + x, 0),
+                                                               glyphWidth));
+                }
+
+                charPosition = charStart + t->range.getEnd();
+
+                const bool isLastInParagraph = (i == tokens.size() - 1);
+                const Token* const nextToken = isLastInParagraph ? nextParagraphStart : &tokens.getReference (i + 1);
+
+                if (nextToken == nullptr) // this is the last token
+                {
+                    addRun (fonts, currentLine, currentRun.release(), t, runStartPosition, charPosition);
+                    currentLine->stringRange = Range<int> (lineStartPosition, charPosition);
+                    layout.addLine (currentLine.release());
+                }
+                else
+                {
+                    if (t->fontIndex != nextToken->fontIndex || t->colour != nextToken->colour)
+                    {
+                        addRun (fonts, currentLine, currentRun.release(), t, runStartPosition, charPosition);
+                        runStartPosition = charPosition;
+                    }
+
+                    // (the next paragraph's line numbers start again from 0, so can't be compared)
+                    if (isLastInParagraph || t->line != nextToken->line)
+                    {
+                        if (currentRun == nullptr)
+                            currentRun = layout.createRun (Range<int>(), 0);
+
+                        addRun (fonts, currentLine, currentRun.release(), t, runStartPosition, charPosition);
+                        currentLine->stringRange = Range<int> (lineStartPosition, charPosition);
+                        layout.addLine (currentLine.release());
+
+                        runStartPosition = charPosition;
+                        lineStartPosition = charPosition;
+                        needToSetLineOrigin = true;
+                    }
+                }
+            }
+        }
+
+        // Changes the tokens' font indexes, when the paragraph moves to a list with a different font table.
+        void remapFonts (const Array<int>& newFontIndexes) noexcept
+        {
+            for (int i = tokens.size(); --i >= 0;)
+            {
+                Token& t = tokens.getReference (i);
+                t.fontIndex = newFontIndexes.getUnchecked (t.fontIndex);
+            }
+        }
+
+        struct TokenLine
+        {
+            int firstToken, numTokens, rightEdge, y;
+            float originX;
+        };
+
+        Array<Token> tokens;
+        Array<TokenLine> lines;
+        Array<int> lineBreaks;
+        Array<int> glyphNumbers;
+        Array<float> glyphXOffsets, glyphWidths;
+        int charStart, byteOffset;  // where the paragraph starts in the text, in characters and in bytes
+        int firstLine, y, height;   // where its lines are in the whole layout
+        bool hasBidiLevels;         // false if all the tokens are known to be at level 0
+
+    private:
+        void addRun (const FontTable& fonts, TextLayout::Line* glyphLine, TextLayout::Run* glyphRun,
+                     const Token* const t, const int start, const int end) const
+        {
+            const Font& font = fonts [t->fontIndex];
+            glyphRun->stringRange = Range<int> (start, end);
+            glyphRun->font = font;
+            glyphRun->colour = t->colour;
+            glyphLine->ascent = jmax (glyphLine->ascent, font.getAscent());
+            glyphLine->descent = jmax (glyphLine->descent, font.getDescent());
+            glyphLine->runs.add (glyphRun);
+        }
+
+        // Returns the width of the tokens from the given one up to the next line-break opportunity
+        // or line-break, not counting any whitespace at the end, which can hang past the margin.
+        int getUnbreakableWidth (const int firstToken) const noexcept
+        {
+            int totalWidth = 0, visibleWidth = 0;
+
+            for (int i = firstToken; i < tokens.size(); ++i)
+            {
+                const Token& t = tokens.getReference (i);
+
+                if (t.isNewLine || (i > firstToken && t.canBreakBefore))
+                    break;
+
+                totalWidth += t.area.getWidth();
+
+                if (! t.isWhitespace)
+                    visibleWidth = totalWidth;
+            }
+
+            return visibleWidth;
+        }
+
+        /*  Chooses the breaks for the paragraph as a whole, in the style of Knuth and Plass,
+            so that the total of the squared space left at the ends of its lines is as small
+            as possible. The last line of the paragraph is free to be as short as it likes.
+
+            A line may start at any token that begins at a line-break opportunity. The search
+            for where each line could start goes back through the earlier break positions until
+            the line would be too wide, so its cost is the number of tokens times the number of
+            break positions that fit on one line. A token that's too wide to fit on any line is
+            given a line of its own, just as the greedy breaker would.
+        */
+        void findOptimalLineBreaks (const int maxWidth, Array<int>& lineBreaks) const
+        {
+            const int numTokens = tokens.size();
+
+            if (numTokens < 2)
+                return;
+
+            // tokenX[i] is where token i would start if everything were on one line, and
+            // visibleEnd[i] is the index after the last visible token that comes before i.
+            Array<int> tokenX, visibleEnd;
+            tokenX.ensureStorageAllocated (numTokens + 1);
+            visibleEnd.ensureStorageAllocated (numTokens + 1);
+
+            int x = 0, lastVisibleEnd = 0;
+
+            for (int i = 0; i < numTokens; ++i)
+            {
+                tokenX.add (x);
+                visibleEnd.add (lastVisibleEnd);
+
+                const Token& t = tokens.getReference (i);
+                x += t.area.getWidth();
+
+                if (! t.isWhitespace)
+                    lastVisibleEnd = i + 1;
+            }
+
+            tokenX.add (x);
+            visibleEnd.add (lastVisibleEnd);
+
+            const double overflowPenalty = 1.0e12;
+
+            Array<double> totalCost;
+            Array<int> previousBreak;
+            totalCost.insertMultiple (0, 0.0, numTokens + 1);
+            previousBreak.insertMultiple (0, 0, numTokens + 1);
+
+            Array<int> candidates;      // the break positions so far
+            candidates.add (0);
+
+            for (int i = 1; i <= numTokens; ++i)
+            {
+                const bool isEnd = (i == numTokens);
+                const bool isMandatory = ! isEnd && tokens.getReference (i - 1).isNewLine;
+
+                if (! (isEnd || isMandatory || tokens.getReference (i).canBreakBefore))
+                    continue;
+
+                double bestCost = -1.0;
+                int bestStart = candidates.getLast();
+
+                for (int j = candidates.size(); --j >= 0;)
+                {
+                    const int start = candidates.getUnchecked (j);
+                    const int lineWidth = tokenX.getUnchecked (jmax (start, visibleEnd.getUnchecked (i)))
+                                            - tokenX.getUnchecked (start);
+                    double cost = totalCost.getUnchecked (start);
+
+                    if (lineWidth > maxWidth)
+                    {
+                        // Only the shortest possible line is allowed to overflow..
+                        if (j < candidates.size() - 1)
+                            break;
+
+                        cost += overflowPenalty + (double) (lineWidth - maxWidth);
+                    }
+                    else if (! (isEnd || isMandatory))
+                    {
+                        const double slack = (double) (maxWidth - lineWidth);
+                        cost += slack * slack;
+                    }
+
+                    if (bestCost < 0 || cost < bestCost)
+                    {
+                        bestCost = cost;
+                        bestStart = start;
+                    }
+                }
+
+                totalCost.set (i, bestCost);
+                previousBreak.set (i, bestStart);
+
+                if (isMandatory)
+                    candidates.clearQuick();
+
+                candidates.add (i);
+            }
+
+            // (the breaks are found from the end backwards, so they're reversed afterwards)
+            const int firstNewBreak = lineBreaks.size();
+
+            for (int i = previousBreak.getUnchecked (numTokens); i > 0; i = previousBreak.getUnchecked (i))
+                lineBreaks.add (i);
+
+            std::reverse (lineBreaks.begin() + firstNewBreak, lineBreaks.end());
+        }
+
+        // Positions the tokens, starting a new line at each of the indexes in lineBreaks.
+        void layoutRuns (ScratchSpace& scratch)
+        {
+            lines.clearQuick();
+
+            int x = 0, lineY = 0, h = 0;
+            int lineStart = 0, nextBreak = 0;
+
+            for (int i = 0; i < tokens.size(); ++i)
+            {
+                if (nextBreak < lineBreaks.size() && lineBreaks.getUnchecked (nextBreak) == i)
+                {
+                    endLine (lineStart, i, h, scratch);
+                    lineStart = i;
+                    x = 0;
+                    lineY += h;
+                    h = 0;
+                    ++nextBreak;
+                }
+
+                Token& t = tokens.getReference (i);
+                t.area.setPosition (x, lineY);
+                t.line = lines.size();
+                x += t.area.getWidth();
+                h = jmax (h, t.area.getHeight());
+            }
+
+            endLine (lineStart, tokens.size(), h, scratch);
+            height = lineY + h;
+        }
+
+        // Records the tokens that make up the line that has just been laid out, along with
+        // the right-hand edge of its last visible token, so that aligning the lines later
+        // on doesn't need to search the whole token list for each of them.
+        void endLine (const int firstToken, const int endToken, const int lineHeight, ScratchSpace& scratch)
+        {
+            TokenLine line;
+            line.firstToken = firstToken;
+            line.numTokens = endToken - firstToken;
+            line.rightEdge = 0;
+            line.y = firstToken < tokens.size() ? tokens.getReference (firstToken).area.getY() : 0;
+            line.originX = 0;
+
+            // (a reordered line has its glyphs positioned from the line's left-hand edge)
+            bool hasFoundOrigin = reorderLine (firstToken, endToken, scratch);
+
+            for (int i = firstToken; i < endToken; ++i)
+            {
+                Token& tok = tokens.getReference (i);
+                tok.lineHeight = lineHeight;
+
+                if (tok.numGlyphs > 0 && ! hasFoundOrigin)
+                {
+                    // (the line's origin is at the first token that has any glyphs)
+                    line.originX = (float) tok.area.getX();
+                    hasFoundOrigin = true;
+                }
+
+                if (! tok.isWhitespace)
+                    line.rightEdge = jmax (line.rightEdge, tok.area.getRight());
+            }
+
+            lines.add (line);
+        }
+
+        /*  L2: reverses the runs of right-to-left tokens in a line, and moves the tokens to
+            their new positions. Any whitespace at the end of the line is treated as being at
+            the paragraph's level (the part of L1 that depends on where the lines break).
+            Returns false if the line is entirely left-to-right, so didn't need reordering.
+        */
+        bool reorderLine (const int firstToken, const int endToken, ScratchSpace& scratch)
+        {
+            const int numTokens = endToken - firstToken;
+
+            if (numTokens <= 0 || ! hasBidiLevels)
+                return false;
+
+            int trailingWhitespaceStart = endToken;
+
+            while (trailingWhitespaceStart > firstToken && tokens.getReference (trailingWhitespaceStart - 1).isWhitespace)
+                --trailingWhitespaceStart;
+
+            const uint8 paragraphLevel = tokens.getReference (firstToken).paragraphLevel;
+            uint8 highestLevel = 0, lowestLevel = 0xff;
+
+            Array<uint8>& lineLevels = scratch.lineLevels;
+            lineLevels.clearQuick();
+
+            for (int i = firstToken; i < endToken; ++i)
+            {
+                const uint8 level = i < trailingWhitespaceStart ? tokens.getReference (i).bidiLevel : paragraphLevel;
+                lineLevels.add (level);
+                highestLevel = jmax (highestLevel, level);
+                lowestLevel = jmin (lowestLevel, level);
+            }
+
+            const uint8 lowestOddLevel = (uint8) (lowestLevel | 1);
+
+            if (highestLevel < lowestOddLevel)
+                return false;
+
+            Array<int>& visualOrder = scratch.visualOrder;
+            visualOrder.clearQuick();
+
+            for (int i = 0; i < numTokens; ++i)
+                visualOrder.add (i);
+
+            int* const order = visualOrder.getRawDataPointer();
+            const uint8* const levels = lineLevels.getRawDataPointer();
+
+            for (int level = highestLevel; level >= lowestOddLevel; --level)
+            {
+                for (int i = 0; i < numTokens;)
+                {
+                    if (levels [order[i]] < level)
+                    {
+                        ++i;
+                        continue;
+                    }
+
+                    int runEnd = i + 1;
+                    while (runEnd < numTokens && levels [order[runEnd]] >= level)
+                        ++runEnd;
+
+                    std::reverse (order + i, order + runEnd);
+                    i = runEnd;
+                }
+            }
+
+            int x = 0;
+
+            for (int i = 0; i < numTokens; ++i)
+            {
+                Token& t = tokens.getReference (firstToken + order[i]);
+                t.area.setX (x);
+                x += t.area.getWidth();
+            }
+
+            return true;
+        }
+
+        JUCE_DECLARE_NON_COPYABLE (TokenParagraph);
+    };
+
+    //==============================================================================
+    /*  The shaped tokens of a whole text, kept as a list of paragraphs. Each paragraph is
+        broken into lines independently of the others, so after an edit, only the paragraphs
+        that contain it need to be tokenized and broken again, and the ones after them are
+        just moved along.
+    */
+    class TokenList
+    {
+    public:
+        TokenList() noexcept
+            : textPosition (sourceText.getCharPointer()), textIndex (0), totalLines (0), totalHeight (0),
+              justificationFlags (0), isRightToLeft (false), isShapingDeferred (false)
+        {}
+
+        /** Splits the text into tokens and shapes them. This only needs doing once, however
+            many different widths the text is then laid out at.
+        */
+        void addText (const AttributedString& text)
+        {
+            addText (text, Range<int> (0, std::numeric_limits<int>::max()));
+        }
+
+        /** Tokenizes just the characters within the given range of the text. */
+        void addText (const AttributedString& text, const Range<int>& characterRange)
+        {
+            const String& s = text.getText();
+            addText (text, characterRange, s.getCharPointer(), 0, s.length());
+        }
+
+        /** Tokenizes the characters within the given range of the text, starting the search
+            for them from a position that the caller has already found. The position must be
+            in the text's own string data, and must not be after the start of the range.
+        */
+        void addText (const AttributedString& text, const Range<int>& characterRange,
+                      const String::CharPointerType& startPosition, const int startIndex,
+                      const int textLength)
+        {
+            justificationFlags = text.getJustification().getFlags();
+            isRightToLeft = text.getReadingDirection() == AttributedString::rightToLeft;
+
+            sourceText = text.getText();
+            textPosition = startPosition;
+            textIndex = startIndex;
+            addTextRuns (text, characterRange, textLength);
+        }
+
+        /** Tokenizes the text using a pool of threads, and then shapes it.
+
+            The text is cut into chunks of whole paragraphs, and each chunk is given its own
+            TokenList by a job on the pool, which splits it into tokens and resolves its bidi
+            levels and line-break opportunities. Any jobs that no thread has started by the time
+            this thread has finished queueing them are taken back and run here, so the calling
+            thread helps out rather than just waiting.
+
+            Fonts load their glyphs lazily, and aren't safe to measure from more than one thread
+            at once, so each font's table of advances is found first, on this thread, and the
+            jobs only shape the tokens that those tables can measure. Finally, the chunks'
+            paragraphs are joined together in order, and any tokens that are left (e.g. ones with
+            characters beyond the tables) are shaped here.
+        */
+        void addTextUsingThreadPool (const AttributedString& text, ThreadPool& pool);
+
+        /** Chooses the line-breaks for the given width, and positions the tokens.
+            If the tokens had already been laid out, this returns the number of lines at the
+            start which contain exactly the same tokens as they did before, otherwise 0.
+        */
+        int breakLines (const int maxWidth, const bool useOptimalLineBreaks)
+        {
+            return breakParagraphs (0, paragraphs.size(), maxWidth, useOptimalLineBreaks);
+        }
+
+        /** Breaks a range of paragraphs into lines, and moves all the paragraphs after the first
+            of them to their new line numbers and positions. Returns the index of the first line
+            that isn't exactly the same as it was before (or the number of lines if none of them
+            have changed).
+        */
+        int breakParagraphs (const int firstParagraph, const int endParagraph,
+                             const int maxWidth, const bool useOptimalLineBreaks)
+        {
+            int firstChangedLine = -1;
+            int line = 0, y = 0;
+
+            if (const TokenParagraph* const previous = paragraphs [firstParagraph - 1])
+            {
+                line = previous->firstLine + previous->getNumLines();
+                y = previous->y + previous->height;
+            }
+
+            for (int i = firstParagraph; i < paragraphs.size(); ++i)
+            {
+                TokenParagraph& p = *paragraphs.getUnchecked (i);
+                p.firstLine = line;
+                p.y = y;
+
+                if (i < endParagraph)
+                {
+                    const int numUnchangedLines = p.breakLines (maxWidth, useOptimalLineBreaks, scratchSpace);
+
+                    if (firstChangedLine < 0 && numUnchangedLines < p.getNumLines())
+                        firstChangedLine = line + numUnchangedLines;
+                }
+
+                line += p.getNumLines();
+                y += p.height;
+            }
+
+            totalLines = line;
+            totalHeight = y;
+            return firstChangedLine < 0 ? totalLines : firstChangedLine;
+        }
+
+        int getNumLines() const noexcept            { return totalLines; }
+        int getNumParagraphs() const noexcept       { return paragraphs.size(); }
+
+        int getNumChars() const noexcept
+        {
+            const TokenParagraph* const last = paragraphs.getLast();
+            return last != nullptr ? last->charStart + last->getNumChars() : 0;
+        }
+
+        /** Returns the index of a paragraph's first character, or the length of the text if
+            the index is beyond the end.
+        */
+        int getParagraphStart (const int paragraphIndex) const noexcept
+        {
+            return paragraphIndex < paragraphs.size() ? paragraphs.getUnchecked (paragraphIndex)->charStart
+                                                      : getNumChars();
+        }
+
+        /** Returns a paragraph's first line, or the number of lines if the index is beyond the end. */
+        int getFirstLineOfParagraph (const int paragraphIndex) const noexcept
+        {
+            return paragraphIndex < paragraphs.size() ? paragraphs.getUnchecked (paragraphIndex)->firstLine
+                                                      : totalLines;
+        }
+
+        /** Returns the y position of a paragraph's first line, or the height of all the lines
+            if the index is beyond the end.
+        */
+        int getParagraphY (const int paragraphIndex) const noexcept
+        {
+            return paragraphIndex < paragraphs.size() ? paragraphs.getUnchecked (paragraphIndex)->y
+                                                      : totalHeight;
+        }
+
+        /** Returns the address of a paragraph's first character in a string, which must be the
+            same as the text that was tokenized, at least up to the start of that paragraph.
+        */
+        String::CharPointerType getParagraphPosition (const String& text, const int paragraphIndex) const noexcept
+        {
+            jassert (isPositiveAndBelow (paragraphIndex, paragraphs.size()));
+            return String::CharPointerType (addBytesToPointer (text.getCharPointer().getAddress(),
+                                                               paragraphs.getUnchecked (paragraphIndex)->byteOffset));
+        }
+
+        /** Returns the range of paragraphs which an edit to the given range of characters could affect. */
+        Range<int> getParagraphsAround (const Range<int>& editedRange) const noexcept
+        {
+            const int numParagraphs = paragraphs.size();
+            jassert (numParagraphs > 0);
+
+            int first = jmin (findParagraphContaining (editedRange.getStart()), numParagraphs - 1);
+
+            // A line-break which ends just where the edit starts might join up with the
+            // new text (e.g. a CR followed by a new LF), so that paragraph is included too.
+            if (first > 0 && paragraphs.getUnchecked (first)->charStart == editedRange.getStart())
+                --first;
+
+            int last = jmin (findParagraphContaining (editedRange.getEnd()), numParagraphs - 1);
+
+            // ..and if the edit ends part-way through a paragraph's line-break, the one after
+            // it could change too.
+            const TokenParagraph& p = *paragraphs.getUnchecked (last);
+            const Token& lastToken = p.tokens.getReference (p.tokens.size() - 1);
+
+            if (last < numParagraphs - 1 && lastToken.isNewLine
+                 && p.charStart + lastToken.range.getStart() < editedRange.getEnd())
+                ++last;
+
+            return Range<int> (first, last + 1);
+        }
+
+        /** Replaces a range of paragraphs with all the paragraphs from another list, which must
+            have been created from the same text after the edit, and leaves the other list empty.
+            The paragraphs after the replaced ones are moved along by charDelta characters, but
+            their lines aren't moved until breakParagraphs() is called.
+        */
+        void replaceParagraphs (const int firstParagraph, const int endParagraph, TokenList& source, const int charDelta)
+        {
+            if (endParagraph < paragraphs.size())
+            {
+                const int byteDelta = source.getEndByteOffset() - paragraphs.getUnchecked (endParagraph)->byteOffset;
+
+                for (int i = endParagraph; i < paragraphs.size(); ++i)
+                {
+                    TokenParagraph& p = *paragraphs.getUnchecked (i);
+                    p.charStart += charDelta;
+                    p.byteOffset += byteDelta;
+                }
+            }
+
+            Array<int> newFontIndexes;
+
+            for (int i = 0; i < source.fonts.size(); ++i)
+                newFontIndexes.add (fonts.getIndexOf (source.fonts [i]));
+
+            paragraphs.removeRange (firstParagraph, endParagraph - firstParagraph);
+
+            for (int i = 0; i < source.paragraphs.size(); ++i)
+            {
+                TokenParagraph* const p = source.paragraphs.getUnchecked (i);
+                p->remapFonts (newFontIndexes);
+                paragraphs.insert (firstParagraph + i, p);
+            }
+
+            source.paragraphs.clear (false);
+
+            sourceText = source.sourceText;
+            textPosition = sourceText.getCharPointer();
+            textIndex = 0;
+        }
+
+        /** Adds the lines from firstLine up to (but not including) endLine to the end of the layout. */
+        void addLines (TextLayout& layout, const int firstLine, const int endLine) const
+        {
+            jassert (firstLine < endLine && endLine <= totalLines);
+            layout.ensureStorageAllocated (totalLines);
+
+            for (int i = findParagraphOfLine (firstLine); i < paragraphs.size(); ++i)
+            {
+                const TokenParagraph& p = *paragraphs.getUnchecked (i);
+
+                if (p.firstLine >= endLine)
+                    break;
+
+                const TokenParagraph* const next = paragraphs [i + 1];
+
+                p.addLines (layout, fonts, jmax (0, firstLine - p.firstLine), jmin (p.getNumLines(), endLine - p.firstLine),
+                            next != nullptr ? &next->tokens.getReference (0) : nullptr);
+            }
+        }
+
+        /** Moves each line to its horizontal position for the given width and justification.
+            This works from the lines' original positions, so it can also be used to re-align
+            lines which were laid out for a different width.
+
+            As with the native engines, left and right justification swap over when the
+            text's reading direction is right-to-left.
+        */
+        void alignLines (OwnedArray<TextLayout::Line>& layoutLines, const float width) const
+        {
+            alignLines (layoutLines, width, 0, totalLines);
+        }
+
+        /** Aligns just the lines from firstLine up to (but not including) endLine. */
+        void alignLines (OwnedArray<TextLayout::Line>& layoutLines, const float width,
+                         const int firstLine, const int endLine) const
+        {
+            const int totalW = (int) width;
+            const bool isCentred = (justificationFlags & Justification::horizontallyCentred) != 0;
+            const bool isRightAligned = (justificationFlags & Justification::right) != 0;
+            const bool isAligned = isCentred || (isRightAligned != isRightToLeft);
+            const int end = jmin (endLine, layoutLines.size());
+
+            for (int i = findParagraphOfLine (firstLine); i < paragraphs.size(); ++i)
+            {
+                const TokenParagraph& p = *paragraphs.getUnchecked (i);
+
+                if (p.firstLine >= end)
+                    break;
+
+                const int paragraphEnd = jmin (p.getNumLines(), end - p.firstLine);
+
+                for (int j = jmax (0, firstLine - p.firstLine); j < paragraphEnd; ++j)
+                {
+                    const TokenParagraph::TokenLine& line = p.lines.getReference (j);
+                    float dx = 0;
+
+                    if (isAligned)
+                    {
+                        dx = (float) (totalW - line.rightEdge);
+
+                        if (isCentred)
+                            dx /= 2.0f;
+                    }
+
+                    layoutLines.getUnchecked (p.firstLine + j)->lineOrigin.x = line.originX + dx;
+                }
+            }
+        }
+
+        /*  Finds the width that createLayoutWithBalancedLineLengths() should use, by stepping down
+            from maxWidth 10 pixels at a time and comparing the lengths of the last two lines.
+            Only the line-breaker is run for each width, and only on the paragraphs that those
+            lines can be in, and the line lengths are only measured again when the breaks have
+            actually changed.
+        */
+        float findBalancedWidth (float maxWidth) const
+        {
+            const int numParagraphs = paragraphs.size();
+
+            if (numParagraphs == 0)
+                return maxWidth;
+
+            // (if the last paragraph fits on one line, the line before it is the end of the previous one)
+            const TokenParagraph& lastParagraph = *paragraphs.getUnchecked (numParagraphs - 1);
+            const TokenParagraph* const previousParagraph = paragraphs [numParagraphs - 2];
+
+            const float minimumWidth = maxWidth / 2.0f;
+            float bestWidth = maxWidth;
+            float bestLineProportion = 0.0f;
+
+            Array<int> lineBreaks, lastLineBreaks, previousLineBreaks, lastPreviousLineBreaks;
+            float prop = 0.0f;
+            bool hasMeasuredLines = false;
+
+            while (maxWidth > minimumWidth)
+            {
+                lineBreaks.clearQuick();
+                lastParagraph.findGreedyLineBreaks ((int) maxWidth, lineBreaks);
+
+                const bool needsPreviousParagraph = (lineBreaks.size() == 0);
+
+                if (needsPreviousParagraph)
+                {
+                    if (previousParagraph == nullptr)
+                        return maxWidth;
+
+                    previousLineBreaks.clearQuick();
+                    previousParagraph->findGreedyLineBreaks ((int) maxWidth, previousLineBreaks);
+                }
+
+                if (! (hasMeasuredLines && lineBreaks == lastLineBreaks
+                        && (previousLineBreaks == lastPreviousLineBreaks || ! needsPreviousParagraph)))
+                {
+                    const int numBreaks = lineBreaks.size();
+                    float line1, line2;
+
+                    if (needsPreviousParagraph)
+                    {
+                        line1 = (float) lastParagraph.getVisibleLength (0, lastParagraph.tokens.size());
+                        line2 = (float) previousParagraph->getVisibleLength (previousLineBreaks.size() > 0 ? previousLineBreaks.getLast() : 0,
+                                                                             previousParagraph->tokens.size());
+                    }
+                    else
+                    {
+                        line1 = (float) lastParagraph.getVisibleLength (lineBreaks.getUnchecked (numBreaks - 1), lastParagraph.tokens.size());
+                        line2 = (float) lastParagraph.getVisibleLength (numBreaks > 1 ? lineBreaks.getUnchecked (numBreaks - 2) : 0,
+                                                                        lineBreaks.getUnchecked (numBreaks - 1));
+                    }
+
+                    const float shortestLine = jmin (line1, line2);
+                    prop = (shortestLine > 0) ? jmax (line1, line2) / shortestLine : 1.0f;
+
+                    lastLineBreaks.swapWith (lineBreaks);
+                    lastPreviousLineBreaks.swapWith (previousLineBreaks);
+                    hasMeasuredLines = true;
+                }
+
+                if (prop > 0.9f)
+                    return maxWidth;
+
+                if (prop > bestLineProportion)
+                {
+                    bestLineProportion = prop;
+                    bestWidth = maxWidth;
+                }
+
+                maxWidth -= 10.0f;
+            }
+
+            return bestWidth;
+        }
+
+    private:
+        static int getCharacterType (const juce_wchar c) noexcept
+        {
+            if (c == '\r' || c == '\n')
+                return 0;
+
+            return CharacterFunctions::isWhitespace (c) ? 2 : 1;
+        }
+
+       #if JUCE_STRING_UTF_TYPE == 8
+        /*  Returns how many of the bytes at the start of some UTF-8 text (up to maxChars of them)
+            are characters that would carry on a token of the given type, without calling
+            getCharacterType() for each one: spaces for a whitespace token, or printable ASCII
+            characters for any other token. Everything else (line-breaks, control characters and
+            anything non-ASCII) stops the scan, and is left to getCharacterType(), so the tokens
+            come out exactly the same as they would without this.
+
+            With SSE2, the bytes are tested 16 at a time.
+        */
+        static int countAsciiCharsInToken (const char* const text, const int maxChars, const bool isWhitespace) noexcept
+        {
+            int n = 0;
+
+           #if JUCE_TEXTLAYOUT_USE_SSE2
+            const __m128i space = _mm_set1_epi8 (' ');
+            const __m128i firstVisible = _mm_set1_epi8 ('!');
+            const __m128i del = _mm_set1_epi8 (0x7f);
+
+            // (only whole blocks of 16 characters are read, so this never goes past the end)
+            while (n + 16 <= maxChars)
+            {
+                const __m128i bytes = _mm_loadu_si128 ((const __m128i*) (text + n));
+
+                // (as the comparison is signed, any byte from 0x80 upwards counts as being below '!')
+                const __m128i endsToken = isWhitespace ? _mm_xor_si128 (_mm_cmpeq_epi8 (bytes, space), _mm_set1_epi8 (-1))
+                                                       : _mm_or_si128 (_mm_cmplt_epi8 (bytes, firstVisible),
+                                                                       _mm_cmpeq_epi8 (bytes, del));
+                int mask = _mm_movemask_epi8 (endsToken);
+
+                if (mask == 0)
+                {
+                    n += 16;
+                    continue;
+                }
+
+                while ((mask & 1) == 0)
+                {
+                    mask >>= 1;
+                    ++n;
+                }
+
+                return n;
+            }
+           #endif
+
+            if (isWhitespace)
+            {
+                while (n < maxChars && text[n] == ' ')
+                    ++n;
+            }
+            else
+            {
+                while (n < maxChars && text[n] > ' ' && text[n] < 0x7f)  // (bytes from 0x80 up fail one test or the other)
+                    ++n;
+            }
+
+            return n;
+        }
+       #endif
+
+        // Returns the index of the first paragraph which ends after the given character.
+        int findParagraphContaining (const int charIndex) const noexcept
+        {
+            int start = 0, end = paragraphs.size();
+
+            while (start < end)
+            {
+                const int mid = (start + end) / 2;
+                const TokenParagraph& p = *paragraphs.getUnchecked (mid);
+
+                if (p.charStart + p.getNumChars() <= charIndex)
+                    start = mid + 1;
+                else
+                    end = mid;
+            }
+
+            return start;
+        }
+
+        // Returns the index of the paragraph that contains the given line, or the number of
+        // paragraphs if the line is beyond the end.
+        int findParagraphOfLine (const int lineIndex) const noexcept
+        {
+            int start = 0, end = paragraphs.size();
+
+            while (start < end)
+            {
+                const int mid = (start + end) / 2;
+                const TokenParagraph& p = *paragraphs.getUnchecked (mid);
+
+                if (p.firstLine + p.getNumLines() <= lineIndex)
+                    start = mid + 1;
+                else
+                    end = mid;
+            }
+
+            return start;
+        }
+
+        // Returns the byte offset in the text of the place where tokenizing stopped.
+        int getEndByteOffset() const noexcept
+        {
+            return getAddressDifference (textPosition.getAddress(), sourceText.getCharPointer().getAddress());
+        }
+
+        // Returns the paragraph that a new token should be added to, starting a new one if
+        // the last paragraph has been ended by a line-break.
+        TokenParagraph& getParagraphForToken (const int charIndex, const String::CharPointerType& position)
+        {
+            TokenParagraph* p = paragraphs.getLast();
+
+            if (p == nullptr || p->endsWithLineBreak())
+            {
+                p = new TokenParagraph (charIndex, getAddressDifference (position.getAddress(),
+                                                                         sourceText.getCharPointer().getAddress()));
+                paragraphs.add (p);
+            }
+
+            return *p;
+        }
+
+        // Each token is shaped exactly once: its width is used for line-breaking, and
+        // the glyphs are kept for createLayout() to emit. If shaping is being deferred,
+        // the token is left empty until shapeDeferredTokens() is called.
+        void addToken (const String::CharPointerType& start, const String::CharPointerType& end,
+                       const Range<int>& range, const int fontIndex, const Colour& colour,
+                       const bool isWhitespace, const bool isNewLine,
+                       const BidiLevels& bidi, const LineBreakOpportunities& breaks)
+        {
+            TokenParagraph& p = getParagraphForToken (range.getStart(), start);
+            const uint8 bidiLevel = bidi.getLevel (range.getStart());
+            const uint8 paragraphLevel = bidi.getParagraphLevel (range.getStart());
+            p.hasBidiLevels = p.hasBidiLevels || bidiLevel != 0 || paragraphLevel != 0;
+
+            p.tokens.add (Token (range - p.charStart, fontIndex, colour, 0, 0, p.glyphNumbers.size(), 0,
+                                 isWhitespace, isNewLine, breaks.isOpportunityAt (range.getStart()),
+                                 bidiLevel, paragraphLevel));
+
+            if (! isShapingDeferred)
+                shapeToken (p, p.tokens.getReference (p.tokens.size() - 1), start, end);
+        }
+
+        // Measures a token, and adds its glyphs to the end of its paragraph's glyph arrays.
+        // Whitespace and line-breaks are only measured, as they never produce any visible glyphs.
+        void shapeToken (TokenParagraph& p, Token& t, const String::CharPointerType& start, const String::CharPointerType& end)
+        {
+            const Font& font = fonts [t.fontIndex];
+
+            scratchGlyphs.clearQuick();
+            scratchOffsets.clearQuick();
+
+            const AdvanceTable* const table = getAdvanceTable (t.fontIndex);
+
+            if (table == nullptr || ! table->getGlyphPositions (start, end, scratchGlyphs, scratchOffsets))
+            {
+                scratchGlyphs.clearQuick();
+                scratchOffsets.clearQuick();
+
+                const WordCache::ScopedAccess access;
+                WordCache* const cache = access.get();
+
+                if (cache != nullptr)
+                    cache->getGlyphPositions (font, getFontKey (t.fontIndex), String (start, end), scratchGlyphs, scratchOffsets);
+                else
+                    font.getGlyphPositions (String (start, end), scratchGlyphs, scratchOffsets);
+            }
+
+            storeShapedToken (p, t);
+        }
+
+        // Adds the glyphs in the scratch arrays to the end of the paragraph's glyph arrays, and
+        // sets the token's size from their offsets.
+        void storeShapedToken (TokenParagraph& p, Token& t)
+        {
+            t.firstGlyph = p.glyphNumbers.size();
+            t.numGlyphs = 0;
+
+            if (! (t.isWhitespace || t.isNewLine))
+            {
+                t.numGlyphs = scratchGlyphs.size();
+
+                for (int i = 0; i < t.numGlyphs; ++i)
+                {
+                    const float x = scratchOffsets.getUnchecked (i);
+                    p.glyphNumbers.add (scratchGlyphs.getUnchecked (i));
+                    p.glyphXOffsets.add (x);
+                    p.glyphWidths.add (scratchOffsets.getUnchecked (i + 1) - x);
+                }
+            }
+
+            const float width = scratchOffsets.size() > 0 ? scratchOffsets.getLast() : 0.0f;
+            t.area.setSize (roundToInt (width), roundToInt (fonts [t.fontIndex].getHeight()));
+            t.isShaped = true;
+        }
+
+        // Shapes any tokens that were added while shaping was deferred, and haven't been shaped since.
+        void shapeDeferredTokens()
+        {
+            shapeDeferredTokens (nullptr);
+        }
+
+        /*  Shapes the deferred tokens whose fonts have tables in the given list, as long as the
+            tables cover all their characters. This only reads the tables, and doesn't touch the
+            fonts' typefaces, so unlike shapeToken(), it's safe to call on any thread. The tokens
+            that are left over can be shaped later on by shapeDeferredTokens().
+        */
+        void shapeDeferredTokensUsingTables (const FontTable& tableFonts, const Array<AdvanceTable::Ptr>& tables)
+        {
+            Array<const AdvanceTable*> tablesForFonts;
+
+            for (int i = 0; i < fonts.size(); ++i)
+            {
+                const AdvanceTable* table = nullptr;
+
+                for (int j = tableFonts.size(); --j >= 0;)
+                {
+                    if (tableFonts [j] == fonts [i])
+                    {
+                        table = tables [j];
+                        break;
+                    }
+                }
+
+                tablesForFonts.add (table);
+            }
+
+            shapeDeferredTokens (&tablesForFonts);
+        }
+
+        // (if a list of tables is given, only the tokens that they can measure are shaped)
+        void shapeDeferredTokens (const Array<const AdvanceTable*>* const tablesForFonts)
+        {
+            for (int i = 0; i < paragraphs.size(); ++i)
+            {
+                TokenParagraph& p = *paragraphs.getUnchecked (i);
+                String::CharPointerType start (getParagraphPosition (sourceText, i));
+                int startIndex = 0;
+
+                for (int j = 0; j < p.tokens.size(); ++j)
+                {
+                    Token& t = p.tokens.getReference (j);
+                    start += (t.range.getStart() - startIndex);
+
+                    String::CharPointerType end (start);
+                    end += t.range.getLength();
+
+                    if (! t.isShaped)
+                    {
+                        if (tablesForFonts == nullptr)
+                        {
+                            shapeToken (p, t, start, end);
+                        }
+                        else if (const AdvanceTable* const table = tablesForFonts->getUnchecked (t.fontIndex))
+                        {
+                            scratchGlyphs.clearQuick();
+                            scratchOffsets.clearQuick();
+
+                            if (table->getGlyphPositions (start, end, scratchGlyphs, scratchOffsets))
+                                storeShapedToken (p, t);
+                        }
+                    }
+
+                    start = end;
+                    startIndex = t.range.getEnd();
+                }
+            }
+        }
+
+
+        const String& getFontKey (const int fontIndex)
+        {
+            while (fontKeys.size() <= fontIndex)
+                fontKeys.add (WordCache::getFontKey (fonts [fontKeys.size()]));
+
+            return fontKeys [fontIndex];
+        }
+
+        // Returns the font's table of advances if it has a usable one, or nullptr.
+        const AdvanceTable* getAdvanceTable (const int fontIndex)
+        {
+            while (advanceTables.size() <= fontIndex)
+            {
+                const int i = advanceTables.size();
+                const WordCache::ScopedAccess access;
+                WordCache* const cache = access.get();
+                advanceTables.add (cache != nullptr ? cache->getAdvanceTable (fonts [i], getFontKey (i)) : AdvanceTable::Ptr());
+            }
+
+            return advanceTables.getReference (fontIndex);
+        }
+
+        // The style runs arrive in order, so the read position in the text only ever moves forwards,
+        // and each token just records where its characters are. A token also ends wherever the
+        // embedding level changes, so that each one can be reordered as a whole, and at every
+        // line-break opportunity, so that the line-breakers only ever need to look at tokens.
+        void appendText (const Range<int>& stringRange, const int fontIndex, const Colour& colour,
+                         const BidiLevels& bidi, const LineBreakOpportunities& breaks)
+        {
+            jassert (stringRange.getStart() >= textIndex);
+            textPosition += (stringRange.getStart() - textIndex);
+            textIndex = stringRange.getStart();
+
+            const int end = stringRange.getEnd();
+            String::CharPointerType tokenStart (textPosition);
+            int tokenStartIndex = textIndex;
+            int lastCharType = 0;
+            uint8 lastLevel = 0;
+            int nextBreak = breaks.getNextOpportunity (textIndex + 1);
+
+           #if JUCE_STRING_UTF_TYPE == 8
+            const bool canSkipAsciiChars = bidi.isAllLeftToRight();
+           #endif
+
+            while (textIndex < end)
+            {
+               #if JUCE_STRING_UTF_TYPE == 8
+                // Any ASCII characters that can't end the current token are skipped over in one go..
+                if (lastCharType != 0 && canSkipAsciiChars)
+                {
+                    const int numToSkip = countAsciiCharsInToken (textPosition.getAddress(), jmin (end, nextBreak) - textIndex,
+                                                                    lastCharType == 2);
+                    textPosition = String::CharPointerType (textPosition.getAddress() + numToSkip);
+                    textIndex += numToSkip;
+
+                    if (textIndex >= end)
+                        break;
+                }
+               #endif
+
+                const String::CharPointerType charStart (textPosition);
+                const int charIndex = textIndex;
+                const juce_wchar c = textPosition.getAndAdvance();
+                ++textIndex;
+
+                const int charType = getCharacterType (c);
+                const uint8 level = bidi.getLevel (charIndex);
+
+                if (charType == 0 || charType != lastCharType || level != lastLevel || charIndex == nextBreak)
+                {
+                    if (charIndex > tokenStartIndex)
+                        addToken (tokenStart, charStart, Range<int> (tokenStartIndex, charIndex),
+                                  fontIndex, colour,
+                                  lastCharType == 2 || lastCharType == 0, lastCharType == 0, bidi, breaks);
+
+                    tokenStart = charStart;
+                    tokenStartIndex = charIndex;
+
+                    if (c == '\r' && textIndex < end && *textPosition == '\n')
+                    {
+                        ++textPosition;
+                        ++textIndex;
+                    }
+                }
+
+                if (charIndex >= nextBreak)
+                    nextBreak = breaks.getNextOpportunity (textIndex);
+
+                lastCharType = charType;
+                lastLevel = level;
+            }
+
+            if (textIndex > tokenStartIndex)
+                addToken (tokenStart, textPosition, Range<int> (tokenStartIndex, textIndex),
+                          fontIndex, colour, lastCharType == 2, lastCharType == 0, bidi, breaks);
         }
 
-        void addTextRuns (const AttributedString& text)
+        struct AttributeBoundary
+        {
+            int position, attributeIndex;
+            bool isStart;
+        };
+
+        struct AttributeBoundaryComparator
+        {
+            static int compareElements (const AttributeBoundary& first, const AttributeBoundary& second) noexcept
+            {
+                return first.position - second.position;
+            }
+        };
+
+        /*  Keeps track of which attributes cover the current position, so that the one
+            with the highest index (i.e. the one that was applied last) can be found quickly.
+            Attributes that have ended are only removed when they reach the top of the heap.
+        */
+        class ActiveAttributes
         {
-            Font defaultFont;
+        public:
+            ActiveAttributes (const Array<bool>& isActive_) noexcept  : isActive (isActive_) {}
+
+            void add (const int attributeIndex)
+            {
+                heap.add (attributeIndex);
+                std::push_heap (heap.begin(), heap.end());
+            }
+
+            int getCurrent() noexcept
+            {
+                while (heap.size() > 0 && ! isActive.getUnchecked (heap.getUnchecked (0)))
+                {
+                    std::pop_heap (heap.begin(), heap.end());
+                    heap.removeLast();
+                }
+
+                return heap.size() > 0 ? heap.getUnchecked (0) : -1;
+            }
+
+        private:
+            const Array<bool>& isActive;
+            Array<int> heap;
+
+            JUCE_DECLARE_NON_COPYABLE (ActiveAttributes);
+        };
+
+        /*  Splits the characters in the given range into runs of the same font and colour, and
+            tokenizes each of them. Only the attributes that overlap the range, or the character
+            before it (which can decide the style of its first run), are looked at, so this
+            takes time in proportion to the size of the range rather than the whole text.
+        */
+        void addTextRuns (const AttributedString& text, const Range<int>& characterRange, const int stringLength)
+        {
+            const int defaultFontIndex = fonts.getIndexOf (Font());
+            const int walkStart = jlimit (0, stringLength, characterRange.getStart() - 1);
+            const int walkEnd = jlimit (walkStart, stringLength, characterRange.getEnd());
+            const Range<int> walkRange (walkStart, walkEnd);
+
             Array<RunAttribute> runAttributes;
+            Array<int> attributeIndexes;        // the original indexes of the attributes that are used
+            Array<int> attributeFontIndexes;
+            Array<AttributeBoundary> boundaries;
 
+            for (int j = 0; j < text.getNumAttributes(); ++j)
             {
-                const int stringLength = text.getText().length();
-                int rangeStart = 0;
-                FontAndColour lastFontAndColour (nullptr);
+                const AttributedString::Attribute* const attr = text.getAttribute (j);
+                const Font* const font = attr->getFont();
+                const Range<int> range (attr->range.getIntersectionWith (Range<int> (0, stringLength)));
 
-                // Iterate through every character in the string
-                for (int i = 0; i < stringLength; ++i)
+                if (! range.isEmpty() && range.intersects (walkRange) && (font != nullptr || attr->getColour() != nullptr))
                 {
-                    FontAndColour newFontAndColour (&defaultFont);
-                    const int numCharacterAttributes = text.getNumAttributes();
+                    const AttributeBoundary start = { range.getStart(), attributeIndexes.size(), true };
+                    const AttributeBoundary end   = { range.getEnd(),   attributeIndexes.size(), false };
+                    boundaries.add (start);
+                    boundaries.add (end);
+
+                    attributeIndexes.add (j);
+                    attributeFontIndexes.add (font != nullptr ? fonts.getIndexOf (*font) : -1);
+                }
+            }
+
+            AttributeBoundaryComparator comparator;
+            boundaries.sort (comparator);
+
+            {
+                Array<bool> isActive;
+                isActive.insertMultiple (0, false, attributeIndexes.size());
 
-                    for (int j = 0; j < numCharacterAttributes; ++j)
+                ActiveAttributes activeFonts (isActive), activeColours (isActive);
+                int rangeStart = walkStart;
+                int nextBoundary = 0;
+                int segmentStart = walkStart;
+                FontAndColour lastFontAndColour (-1);
+
+                // Walk through the sections between attribute boundaries, producing the same runs
+                // as checking every attribute for every character would do.
+                while (segmentStart < walkEnd)
+                {
+                    while (nextBoundary < boundaries.size()
+                            && boundaries.getReference (nextBoundary).position <= segmentStart)
                     {
-                        const AttributedString::Attribute* const attr = text.getAttribute (j);
+                        const AttributeBoundary& b = boundaries.getReference (nextBoundary++);
+                        isActive.set (b.attributeIndex, b.isStart);
 
-                        // Check if the current character falls within the range of a font attribute
-                        if (attr->getFont() != nullptr && (i >= attr->range.getStart()) && (i < attr->range.getEnd()))
-                            newFontAndColour.font = attr->getFont();
+                        if (b.isStart)
+                        {
+                            const AttributedString::Attribute* const attr = text.getAttribute (attributeIndexes.getUnchecked (b.attributeIndex));
 
-                        // Check if the current character falls within the range of a foreground colour attribute
-                        if (attr->getColour() != nullptr && (i >= attr->range.getStart()) && (i < attr->range.getEnd()))
-                            newFontAndColour.colour = *attr->getColour();
+                            if (attr->getFont() != nullptr)     activeFonts.add (b.attributeIndex);
+                            if (attr->getColour() != nullptr)   activeColours.add (b.attributeIndex);
+                        }
                     }
 
-                    if (i > 0 && (newFontAndColour != lastFontAndColour || i == stringLength - 1))
+                    const int segmentEnd = nextBoundary < boundaries.size()
+                                             ? boundaries.getReference (nextBoundary).position
+                                             : stringLength;
+
+                    FontAndColour newFontAndColour (defaultFontIndex);
+
+                    const int fontAttribute = activeFonts.getCurrent();
+                    if (fontAttribute >= 0)
+                        newFontAndColour.fontIndex = attributeFontIndexes.getUnchecked (fontAttribute);
+
+                    const int colourAttribute = activeColours.getCurrent();
+                    if (colourAttribute >= 0)
+                        newFontAndColour.colour = *text.getAttribute (attributeIndexes.getUnchecked (colourAttribute))->getColour();
+
+                    // The first character of the section may start a new run..
+                    const int i = segmentStart;
+
+                    if (i > walkStart && (newFontAndColour != lastFontAndColour || i == stringLength - 1))
                     {
                         runAttributes.add (RunAttribute (lastFontAndColour,
                                                          Range<int> (rangeStart, (i < stringLength - 1) ? i : (i + 1))));
@@ -541,39 +4266,491 @@ namespace TextLayoutHelpers
                     }
 
                     lastFontAndColour = newFontAndColour;
+
+                    // ..and the rest of it only matters if it contains the last character.
+                    if (segmentEnd == stringLength && stringLength - 1 > i)
+                        runAttributes.add (RunAttribute (lastFontAndColour, Range<int> (rangeStart, stringLength)));
+
+                    segmentStart = segmentEnd;
                 }
+
+                // (if the walk stopped before the end of the text, the run that it was in ends here)
+                if (segmentStart < stringLength && rangeStart < segmentStart)
+                    runAttributes.add (RunAttribute (lastFontAndColour, Range<int> (rangeStart, segmentStart)));
             }
 
+            const Range<int> textRange (characterRange.getIntersectionWith (Range<int> (textIndex, stringLength)));
+            String::CharPointerType textRangeStart (textPosition);
+            textRangeStart += (textRange.getStart() - textIndex);
+
+            BidiLevels bidi;
+            bidi.resolve (textRangeStart, textRange.getStart(), textRange.getLength(), text.getReadingDirection());
+
+            LineBreakOpportunities breaks;
+            breaks.find (textRangeStart, textRange.getStart(), textRange.getLength());
+
             for (int i = 0; i < runAttributes.size(); ++i)
             {
                 const RunAttribute& r = runAttributes.getReference(i);
-                appendText (text, r.range, *(r.fontAndColour.font), r.fontAndColour.colour);
+                const Range<int> range (r.range.getIntersectionWith (characterRange));
+
+                if (! range.isEmpty())
+                    appendText (range, r.fontAndColour.fontIndex, r.fontAndColour.colour, bidi, breaks);
             }
         }
 
-        OwnedArray<Token> tokens;
-        int totalLines;
+        String sourceText;
+        String::CharPointerType textPosition;
+        int textIndex;
+
+        OwnedArray<TokenParagraph> paragraphs;
+        TokenParagraph::ScratchSpace scratchSpace;
+        Array<int> scratchGlyphs;
+        Array<float> scratchOffsets;
+        FontTable fonts;
+        StringArray fontKeys;
+        Array<AdvanceTable::Ptr> advanceTables;
+        int totalLines, totalHeight;
+        int justificationFlags;
+        bool isRightToLeft;
+        bool isShapingDeferred; // true if tokens are being added without being shaped
+
+        class ChunkJob;
 
         JUCE_DECLARE_NON_COPYABLE (TokenList);
     };
+
+    class TokenList::ChunkJob  : public ThreadPoolJob
+    {
+    public:
+        ChunkJob (const AttributedString& text_, const Range<int>& range_,
+                  const String::CharPointerType& startPosition_, const int textLength_,
+                  const FontTable& tableFonts_, const Array<AdvanceTable::Ptr>& tables_)
+            : ThreadPoolJob ("TextLayout"), text (text_), range (range_),
+              startPosition (startPosition_), textLength (textLength_),
+              tableFonts (tableFonts_), tables (tables_), hasRun (false)
+        {
+            // (fonts can't safely be used by more than one thread, so only the tokens that the
+            // advance tables can measure are shaped here, and the rest are shaped afterwards,
+            // by the thread that's waiting for the jobs)
+            tokens.isShapingDeferred = true;
+        }
+
+        JobStatus runJob()
+        {
+            tokens.addText (text, range, startPosition, range.getStart(), textLength);
+            tokens.shapeDeferredTokensUsingTables (tableFonts, tables);
+            hasRun = true;
+            return jobHasFinished;
+        }
+
+        const AttributedString& text;
+        const Range<int> range;
+        const String::CharPointerType startPosition;
+        const int textLength;
+        const FontTable& tableFonts;
+        const Array<AdvanceTable::Ptr>& tables;
+        TokenList tokens;
+        bool hasRun;
+
+    private:
+        JUCE_DECLARE_NON_COPYABLE (ChunkJob);
+    };
+
+    void TokenList::addTextUsingThreadPool (const AttributedString& text, ThreadPool& pool)
+    {
+        const String& s = text.getText();
+        const int minChunkSize = 4096;
+
+        OwnedArray<ChunkJob> jobs;
+        FontTable tableFonts;
+        Array<AdvanceTable::Ptr> tables;
+        String::CharPointerType p (s.getCharPointer());
+        String::CharPointerType chunkStartPosition (p);
+        int index = 0, chunkStart = 0;
+
+        // (aim for a few chunks per thread, so that they can balance each other out)
+        const int textLength = s.length();
+        const int chunkSize = jmax (minChunkSize, textLength / jmax (1, pool.getNumThreads() * 4));
+
+        for (;;)
+        {
+            const juce_wchar c = p.getAndAdvance();
+
+            if (c == 0)
+                break;
+
+            ++index;
+
+            if (c == '\r' && *p == '\n')
+            {
+                ++p;
+                ++index;
+            }
+            else if (c != '\n' && c != '\r')
+            {
+                continue;
+            }
+
+            if (index - chunkStart >= chunkSize && index < textLength)
+            {
+                jobs.add (new ChunkJob (text, Range<int> (chunkStart, index), chunkStartPosition, textLength, tableFonts, tables));
+                chunkStart = index;
+                chunkStartPosition = p;
+            }
+        }
+
+        if (jobs.size() == 0)
+        {
+            addText (text, Range<int> (0, textLength), s.getCharPointer(), 0, textLength);
+            return;
+        }
+
+        jobs.add (new ChunkJob (text, Range<int> (chunkStart, textLength), chunkStartPosition, textLength, tableFonts, tables));
+
+        // Each font's table of advances is fetched (or built) here before the jobs start, as that
+        // means shaping with the font. After that, the tables are only read, so the jobs can use
+        // them to shape any tokens whose characters they cover.
+        {
+            tableFonts.getIndexOf (Font());
+
+            for (int i = 0; i < text.getNumAttributes(); ++i)
+                if (const Font* const font = text.getAttribute (i)->getFont())
+                    tableFonts.getIndexOf (*font);
+
+            const WordCache::ScopedAccess access;
+
+            if (WordCache* const cache = access.get())
+                for (int i = 0; i < tableFonts.size(); ++i)
+                    tables.add (cache->getAdvanceTable (tableFonts [i], WordCache::getFontKey (tableFonts [i]), true));
+        }
+
+        for (int i = 0; i < jobs.size(); ++i)
+            pool.addJob (jobs.getUnchecked (i), false);
+
+        for (int i = jobs.size(); --i >= 0;)
+        {
+            ChunkJob* const job = jobs.getUnchecked (i);
+
+            if (pool.removeJob (job, false, 0) && ! job->hasRun)
+                job->runJob();
+        }
+
+        justificationFlags = text.getJustification().getFlags();
+        isRightToLeft = text.getReadingDirection() == AttributedString::rightToLeft;
+        sourceText = s;
+        textPosition = sourceText.getCharPointer();
+        textIndex = 0;
+
+        for (int i = 0; i < jobs.size(); ++i)
+        {
+            ChunkJob* const job = jobs.getUnchecked (i);
+            pool.waitForJobToFinish (job, -1);
+            replaceParagraphs (paragraphs.size(), paragraphs.size(), job->tokens, 0);
+        }
+
+        shapeDeferredTokens();
+    }
+}
+
+//==============================================================================
+class TextLayout::ShapedText::Pimpl
+{
+public:
+    Pimpl (const AttributedString& t)
+        : text (t), useOptimalLineBreaks (false), isFallbackForNativeLayout (false)
+    {
+        tokens.addText (text);
+    }
+
+    Pimpl (const AttributedString& t, ThreadPool& pool)
+        : text (t), useOptimalLineBreaks (false), isFallbackForNativeLayout (false)
+    {
+        tokens.addTextUsingThreadPool (text, pool);
+    }
+
+    bool hasSameParagraphStyle (const AttributedString& other) const
+    {
+        return text.getJustification().getFlags() == other.getJustification().getFlags()
+                && text.getWordWrap() == other.getWordWrap()
+                && text.getReadingDirection() == other.getReadingDirection()
+                && text.getLineSpacing() == other.getLineSpacing();
+    }
+
+    bool isSameAs (const AttributedString& other) const
+    {
+        if (text.getText() != other.getText()
+             || ! hasSameParagraphStyle (other)
+             || text.getNumAttributes() != other.getNumAttributes())
+            return false;
+
+        for (int i = text.getNumAttributes(); --i >= 0;)
+        {
+            const AttributedString::Attribute* const a1 = text.getAttribute (i);
+            const AttributedString::Attribute* const a2 = other.getAttribute (i);
+
+            if (a1->range != a2->range
+                 || (a1->getFont() == nullptr) != (a2->getFont() == nullptr)
+                 || (a1->getColour() == nullptr) != (a2->getColour() == nullptr)
+                 || (a1->getFont() != nullptr && *a1->getFont() != *a2->getFont())
+                 || (a1->getColour() != nullptr && *a1->getColour() != *a2->getColour()))
+                return false;
+        }
+
+        return true;
+    }
+
+    AttributedString text;
+    TextLayoutHelpers::TokenList tokens;
+    bool useOptimalLineBreaks;  // the mode in which the tokens were last laid out
+
+    // True if the native engine couldn't lay out this text, so that createLayout() would use
+    // the standard engine for it too. Otherwise, re-using these tokens for createLayout() would
+    // switch a layout to a different engine on platforms that have a native one.
+    bool isFallbackForNativeLayout;
+
+    bool canBeUsedBy (const bool useOptimalLineBreaksNow) const noexcept
+    {
+        return useOptimalLineBreaksNow ? useOptimalLineBreaks
+                                       : (! useOptimalLineBreaks && isFallbackForNativeLayout);
+    }
+
+private:
+    JUCE_DECLARE_NON_COPYABLE (Pimpl);
+};
+
+TextLayout::ShapedText::ShapedText (const AttributedString& text)
+    : pimpl (new Pimpl (text))
+{
+}
+
+TextLayout::ShapedText::ShapedText (const AttributedString& text, ThreadPool& pool)
+    : pimpl (new Pimpl (text, pool))
+{
+}
+
+TextLayout::ShapedText::~ShapedText()
+{
+}
+
+const AttributedString& TextLayout::ShapedText::getText() const noexcept
+{
+    return pimpl->text;
+}
+
+void TextLayout::createLayoutUsingThreadPool (const AttributedString& text, float maxWidth, ThreadPool& pool)
+{
+    clearLines();
+    width = maxWidth;
+    justification = text.getJustification();
+
+    ScopedPointer<ShapedText> newShapedText (new ShapedText (text, pool));
+    layOutShapedText (*newShapedText, false, false);
+
+    shapedText = newShapedText;
+    shapedTextWidth = width;
+    finishLayout (text, false);
+}
+
+void TextLayout::createLayout (const ShapedText& source, float maxWidth)
+{
+    clearLines();
+    width = maxWidth;
+    justification = source.pimpl->text.getJustification();
+
+    layOutShapedText (source, false, false);
+
+    finishLayout (source.pimpl->text, false);
+}
+
+/*  Breaks some shaped text into lines at the current width, and adds them to the layout.
+    If the layout already contains the lines that this text produced at a previous width,
+    the ones at the start which haven't changed are kept, and just re-aligned.
+*/
+void TextLayout::layOutShapedText (const ShapedText& source, const bool useOptimalLineBreaks,
+                                   const bool canKeepExistingLines)
+{
+    TextLayoutHelpers::TokenList& tokens = source.pimpl->tokens;
+    source.pimpl->useOptimalLineBreaks = useOptimalLineBreaks;
+
+    int firstNewLine = tokens.breakLines ((int) width, useOptimalLineBreaks);
+
+    if (! canKeepExistingLines)
+        firstNewLine = 0;
+
+    SharedData& d = getWritableData();
+
+    if (firstNewLine < tokens.getNumLines())
+    {
+        getArena().recycle (d.lines, firstNewLine);
+        tokens.addLines (*this, firstNewLine, tokens.getNumLines());
+    }
+
+    tokens.alignLines (d.lines, width);
+}
+
+/*  If this layout was made by the standard engine from the same text, this re-uses
+    the shaped text that it kept, and replaces only the lines that have changed.
+*/
+bool TextLayout::updateShapedLayout (const AttributedString& text, const float maxWidth,
+                                     const bool useOptimalLineBreaks)
+{
+    if (shapedText == nullptr
+         || ! shapedText->pimpl->canBeUsedBy (useOptimalLineBreaks)
+         || shapedText->pimpl->tokens.getNumLines() != getNumLines()
+         || ! shapedText->pimpl->isSameAs (text))
+        return false;
+
+    if (maxWidth != shapedTextWidth)
+    {
+        expandLines();
+        width = maxWidth;
+        shapedTextWidth = maxWidth;
+
+        layOutShapedText (*shapedText, useOptimalLineBreaks, true);
+        finishLayout (text, false);
+    }
+
+    return true;
+}
+
+void TextLayout::updateLayoutAfterEdit (const AttributedString& newText, float maxWidth,
+                                        const Range<int>& replacedRange, const int numCharsInserted)
+{
+    if (! updateShapedLayoutAfterEdit (newText, maxWidth, replacedRange, numCharsInserted))
+        createLayout (newText, maxWidth);
+}
+
+/*  Each paragraph is laid out independently of the others, so after an edit, only the
+    paragraphs that contain it need to be tokenized and broken into lines again. The
+    lines before them are kept as they are, and the ones after them just get moved.
+    Moving, aligning and measuring the lines still touches every line in the layout,
+    but that's cheap compared with shaping and breaking the text.
+*/
+bool TextLayout::updateShapedLayoutAfterEdit (const AttributedString& newText, const float maxWidth,
+                                              const Range<int>& replacedRange, const int numCharsInserted)
+{
+    if (shapedText == nullptr || maxWidth != shapedTextWidth)
+        return false;
+
+    ShapedText::Pimpl& shaped = *shapedText->pimpl;
+    TextLayoutHelpers::TokenList& tokens = shaped.tokens;
+    const int oldLength = tokens.getNumChars();
+    const int charDelta = numCharsInserted - replacedRange.getLength();
+
+    if (tokens.getNumParagraphs() == 0
+         || tokens.getNumLines() != getNumLines()
+         || replacedRange.getStart() < 0 || replacedRange.getEnd() > oldLength
+         || ! shaped.canBeUsedBy (shaped.useOptimalLineBreaks)
+         || ! shaped.hasSameParagraphStyle (newText))
+        return false;
+
+    // (this isn't checked at run-time, as counting the characters would take as long as the whole text)
+    jassert (newText.getText().length() == oldLength + charDelta);
+
+    const Range<int> oldParagraphs (tokens.getParagraphsAround (replacedRange));
+    const int firstParagraph = oldParagraphs.getStart();
+    const int firstLine = tokens.getFirstLineOfParagraph (firstParagraph);
+    const int oldEndLine = tokens.getFirstLineOfParagraph (oldParagraphs.getEnd());
+    const int oldEndY = tokens.getParagraphY (oldParagraphs.getEnd());
+
+    // Nothing before these paragraphs has changed, so their new text can be found at the same
+    // place in the new string, without walking through everything that comes before it.
+    const int startIndex = tokens.getParagraphStart (firstParagraph);
+    TextLayoutHelpers::TokenList newTokens;
+    newTokens.addText (newText, Range<int> (startIndex, tokens.getParagraphStart (oldParagraphs.getEnd()) + charDelta),
+                       tokens.getParagraphPosition (newText.getText(), firstParagraph), startIndex, oldLength + charDelta);
+
+    const int newEndParagraph = firstParagraph + newTokens.getNumParagraphs();
+    tokens.replaceParagraphs (firstParagraph, oldParagraphs.getEnd(), newTokens, charDelta);
+
+    width = maxWidth;
+    tokens.breakParagraphs (firstParagraph, newEndParagraph, (int) width, shaped.useOptimalLineBreaks);
+
+    const int newEndLine = tokens.getFirstLineOfParagraph (newEndParagraph);
+    const float dy = (float) (tokens.getParagraphY (newEndParagraph) - oldEndY);
+
+    expandLines();
+    OwnedArray<Line>& lines = getWritableData().lines;
+    jassert (tokens.getNumLines() == lines.size() + (newEndLine - oldEndLine));
+
+    // take the lines after the edited paragraphs out, replace the edited ones, and then put them back
+    OwnedArray<Line> followingLines;
+    followingLines.ensureStorageAllocated (lines.size() - oldEndLine);
+
+    for (int i = oldEndLine; i < lines.size(); ++i)
+        followingLines.add (lines.getUnchecked (i));
+
+    lines.removeRange (oldEndLine, lines.size() - oldEndLine, false);
+    getArena().recycle (lines, firstLine);
+
+    if (newEndLine > firstLine)
+        tokens.addLines (*this, firstLine, newEndLine);
+
+    for (int i = 0; i < followingLines.size(); ++i)
+    {
+        Line* const line = followingLines.getUnchecked (i);
+        line->stringRange += charDelta;
+        line->lineOrigin.y += dy;
+
+        for (int j = line->runs.size(); --j >= 0;)
+            line->runs.getUnchecked (j)->stringRange += charDelta;
+
+        lines.add (line);
+    }
+
+    followingLines.clear (false);
+
+    // All the lines are aligned again, not just the new ones, because the others still have the
+    // shift that recalculateWidth() gave them last time, and it will shift them all again.
+    tokens.alignLines (lines, width);
+    shaped.text = newText;
+    finishLayout (newText, false);
+    return true;
 }
 
 //==============================================================================
 void TextLayout::createLayoutWithBalancedLineLengths (const AttributedString& text, float maxWidth)
 {
+    clearLines();
+    width = maxWidth;
+    justification = text.getJustification();
+
+    if (! createNativeLayout (text))
+    {
+        // The standard engine can shape the text once, and then just try out
+        // each width with its line-breaker..
+        ScopedPointer<ShapedText> newShapedText (new ShapedText (text));
+        width = newShapedText->pimpl->tokens.findBalancedWidth (maxWidth);
+        layOutShapedText (*newShapedText, false, false);
+        newShapedText->pimpl->isFallbackForNativeLayout = true;
+
+        shapedText = newShapedText;
+        shapedTextWidth = width;
+        finishLayout (text, false);
+        return;
+    }
+
+    // ..but a native layout has to be created again from scratch for each width.
+    finishLayout (text, true);
+
     const float minimumWidth = maxWidth / 2.0f;
     float bestWidth = maxWidth;
     float bestLineProportion = 0.0f;
+    bool isFirstWidth = true;
 
     while (maxWidth > minimumWidth)
     {
-        createLayout (text, maxWidth);
+        if (! isFirstWidth)
+            createLayout (text, maxWidth);
+
+        isFirstWidth = false;
 
         if (getNumLines() < 2)
             return;
 
-        const float line1 = lines.getUnchecked (lines.size() - 1)->getLineBoundsX().getLength();
-        const float line2 = lines.getUnchecked (lines.size() - 2)->getLineBoundsX().getLength();
+        const float line1 = getLineBoundsX (getNumLines() - 1).getLength();
+        const float line2 = getLineBoundsX (getNumLines() - 2).getLength();
         const float shortestLine = jmin (line1, line2);
         const float prop = (shortestLine > 0) ? jmax (line1, line2) / shortestLine : 1.0f;
 
@@ -594,16 +4771,45 @@ void TextLayout::createLayoutWithBalancedLineLengths (const AttributedString& te
 }
 
 //==============================================================================
-void TextLayout::createStandardLayout (const AttributedString& text)
+void TextLayout::createStandardLayout (const AttributedString& text, const bool useOptimalLineBreaks)
+{
+    // The shaped text is kept, so that if the same text is laid out again at a
+    // different width, only the line-breaking needs to be re-done.
+    ScopedPointer<ShapedText> newShapedText (new ShapedText (text));
+    layOutShapedText (*newShapedText, useOptimalLineBreaks, false);
+
+    shapedText = newShapedText;
+    shapedTextWidth = width;
+}
+
+void TextLayout::cacheLineBounds()
 {
-    TextLayoutHelpers::TokenList l;
-    l.createLayout (text, *this);
+    if (data != nullptr)
+    {
+        OwnedArray<Line>& lines = data->lines;
+
+        for (int i = lines.size(); --i >= 0;)
+        {
+            Line& line = *lines.getUnchecked (i);
+
+            // (lines that were kept from a previous layout will already have been measured)
+            if (! line.hasGlyphBoundsX)
+            {
+                line.glyphBoundsX = line.calculateGlyphBoundsX();
+                line.hasGlyphBoundsX = true;
+            }
+        }
+    }
 }
 
-void TextLayout::recalculateWidth(const AttributedString& text)
+void TextLayout::recalculateWidth (const AttributedString& text, const bool isNativeLayout)
 {
-    if (lines.size() > 0 && text.getReadingDirection() != AttributedString::rightToLeft)
+    // The native engines position right-to-left lines against the full width, so those
+    // layouts are left as they are. The standard engine's lines can be measured like any others.
+    if (getNumLines() > 0 && ! (isNativeLayout && text.getReadingDirection() == AttributedString::rightToLeft))
     {
+        OwnedArray<Line>& lines = getWritableData().lines;
+
         Range<float> range (lines.getFirst()->getLineBoundsX());
 
         int i;
@@ -37,6 +37,11 @@ class Graphics;
     A TextLayout is created from an AttributedString, and once created can be
     quickly drawn into a Graphics context.
 
+    Copying a TextLayout is cheap, because the copies share the same immutable
+    set of lines until one of them is modified with getLine(), addLine() or
+    createLayout(). Layouts which share their data may be drawn concurrently from
+    different threads, as long as each thread uses its own TextLayout object.
+
     @see AttributedString
 */
 class JUCE_API  TextLayout
@@ -47,7 +52,17 @@ public:
         createLayoutWithBalancedLineLengths().
     */
     TextLayout();
+
+    /** Creates a copy of another layout.
+        This doesn't copy any glyphs - the two layouts will share their data until one
+        of them is modified.
+    */
     TextLayout (const TextLayout&);
+
+    /** Makes this a copy of another layout.
+        This doesn't copy any glyphs - the two layouts will share their data until one
+        of them is modified.
+    */
     TextLayout& operator= (const TextLayout&);
    #if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
     TextLayout (TextLayout&& other) noexcept;
@@ -57,12 +72,83 @@ public:
     /** Destructor. */
     ~TextLayout();
 
+    //==============================================================================
+    /** An AttributedString that has been split into words and shaped, ready to be laid out.
+
+        Creating a layout involves two stages: measuring the glyphs of every word, and then
+        deciding where the lines should break. Only the second stage depends on the width,
+        so if the same text needs to be laid out at lots of different widths (e.g. while a
+        window is being resized), you can keep one of these objects and pass it to
+        TextLayout::createLayout (const ShapedText&, float) to do just the line-breaking.
+
+        This always uses JUCE's own layout engine, even on platforms with a native one.
+        A ShapedText mustn't be used by more than one thread at the same time.
+    */
+    class JUCE_API  ShapedText
+    {
+    public:
+        /** Splits up and shapes the given text. */
+        explicit ShapedText (const AttributedString& text);
+
+        /** Splits up and shapes the given text, using a pool of threads to work on
+            different paragraphs at the same time.
+            @see TextLayout::createLayoutUsingThreadPool
+        */
+        ShapedText (const AttributedString& text, ThreadPool& pool);
+
+        /** Destructor. */
+        ~ShapedText();
+
+        /** Returns the text that was shaped. */
+        const AttributedString& getText() const noexcept;
+
+    private:
+        class Pimpl;
+        friend class TextLayout;
+        ScopedPointer<Pimpl> pimpl;
+
+        JUCE_DECLARE_NON_COPYABLE (ShapedText);
+    };
+
     //==============================================================================
     /** Creates a layout from the given attributed string.
         This will replace any data that is currently stored in the layout.
+
+        When JUCE's own layout engine is being used, the layout keeps the shaped text, so
+        if it's asked to lay out an identical string again with a different width (e.g. while
+        a component is being resized), it only re-does the line-breaking, and keeps any lines
+        at the start which haven't changed. Calling getLine() discards the shaped text.
     */
     void createLayout (const AttributedString& text, float maxWidth);
 
+    /** Creates a layout from some text that has already been shaped.
+        This only needs to break the text into lines and position them, so it's a much
+        quicker way to lay out the same text at different widths.
+        @see ShapedText
+    */
+    void createLayout (const ShapedText& shapedText, float maxWidth);
+
+    /** Updates the layout after a change to the text that it was created from.
+
+        If this layout was made by JUCE's own layout engine, only the paragraphs which
+        contain the edit are shaped and broken into lines again. The lines before them are
+        left alone, and the ones after them are just moved to their new positions, so for a
+        large document, this is much quicker than calling createLayout() again. It still
+        takes some time in proportion to the number of lines, as they all have to be moved,
+        re-aligned and measured. Otherwise, or if the layout has been modified since it was
+        created, this just calls createLayout().
+
+        Any attributes outside the edited range must be the same as they were before, just
+        moved along by the change in the text's length.
+
+        @param newText            the whole of the text, after the edit
+        @param maxWidth           the width that the layout was created with
+        @param replacedRange      the range of characters in the old text that were replaced
+        @param numCharsInserted   the number of new characters that replaced them
+    */
+    void updateLayoutAfterEdit (const AttributedString& newText, float maxWidth,
+                                const Range<int>& replacedRange, int numCharsInserted);
+
     /** Creates a layout, attempting to choose a width which results in lines
         of a similar length.
 
@@ -71,12 +157,105 @@ public:
     */
     void createLayoutWithBalancedLineLengths (const AttributedString& text, float maxWidth);
 
+    /** Creates a layout, choosing the line-breaks for each paragraph as a whole rather
+        than one line at a time.
+
+        Rather than filling each line before moving on to the next one, this picks the
+        set of breaks that leaves the least total space at the ends of the lines (in the
+        style of Knuth and Plass), which gives more even right-hand edges.
+
+        This always uses JUCE's own layout engine, even on platforms with a native one.
+        It costs about the same as createLayout().
+    */
+    void createLayoutWithOptimalLineBreaks (const AttributedString& text, float maxWidth);
+
+    /** Creates a layout, using a ThreadPool to work on several paragraphs at once.
+
+        The text is split into chunks at its hard line-breaks. Jobs on the pool split the chunks
+        into words and work out their bidi levels and line-break opportunities, while the calling
+        thread runs any jobs that haven't been started yet.
+
+        Fonts can't safely be measured from more than one thread at once, so the calling thread
+        first builds a table of advances for each font, and the jobs use these to shape the words
+        in parallel. The tables only cover the first 256 code points, so any words with other
+        characters are shaped afterwards on the calling thread, which for text that's mostly
+        in other scripts means that the shaping is serial. The line-breaking and positioning
+        is also done on the calling thread. This is only worth doing for very large
+        amounts of text; for anything shorter than a few thousand characters it just does the
+        work directly.
+
+        This always uses JUCE's own layout engine, even on platforms with a native one.
+
+        A later call to createLayout() with the same text doesn't re-use this layout's shaped
+        text, because createLayout() picks its engine in the usual way. So it may produce a
+        native layout, and always shapes the text again.
+    */
+    void createLayoutUsingThreadPool (const AttributedString& text, float maxWidth, ThreadPool& pool);
+
     /** Draws the layout within the specified area.
         The position of the text within the rectangle is controlled by the justification
         flags set in the original AttributedString that was used to create this layout.
     */
     void draw (Graphics& g, const Rectangle<float>& area) const;
 
+    //==============================================================================
+    /** Selects the way in which a layout holds its glyphs in memory.
+        @see setStorageMode
+    */
+    enum StorageMode
+    {
+        objectStorage,  /**< Each Line and Run is a separate object. This is the default. */
+        flatStorage,    /**< All the glyphs are held in contiguous parallel arrays, and lines and
+                             runs are just index ranges into them. Large layouts use far fewer
+                             allocations this way, and draw() walks linear memory. */
+        compactStorage  /**< Like flatStorage, but glyph codes are stored as 16-bit values, and
+                             glyph positions and widths as fixed-point values with a resolution of
+                             1/64 of a pixel. This uses around 10 bytes per glyph instead of 16.
+                             Layouts containing glyphs which can't be represented this way are
+                             held in the flatStorage format instead. */
+    };
+
+    /** Changes the way that this layout stores its glyphs.
+
+        If the layout already contains some lines, they'll be converted to the new format.
+        Note that in flatStorage or compactStorage mode, calling getLine() or addLine() converts
+        the layout back into Line and Run objects so that they can be modified, so these formats
+        are best suited to layouts which are created and then just drawn.
+    */
+    void setStorageMode (StorageMode newMode);
+
+    /** Returns the way that this layout stores its glyphs.
+        @see setStorageMode
+    */
+    StorageMode getStorageMode() const noexcept     { return storageMode; }
+
+    //==============================================================================
+    /** Writes the layout to a stream in a binary format.
+
+        The data can be loaded again with loadFromMemory() or loadFromFile(). It is laid out
+        so that it can be drawn directly from memory without being parsed, but it uses the
+        byte order of the machine that wrote it, and refers to fonts by name, so it should
+        only be loaded on the same platform with the same fonts installed.
+    */
+    void writeToStream (OutputStream& output) const;
+
+    /** Replaces this layout with one that was saved by writeToStream().
+
+        The glyphs are used in-place rather than being copied, so the memory must remain
+        valid for as long as this layout (or any copy of it) is still using it, i.e. until
+        it is re-laid out or modified with getLine() or addLine(). The data must be aligned
+        to a 4-byte boundary.
+
+        Returns false if the data isn't a valid layout, in which case the layout will be empty.
+    */
+    bool loadFromMemory (const void* data, size_t dataSize);
+
+    /** Replaces this layout with one that was saved by writeToStream(), by memory-mapping
+        the given file. The file stays mapped for as long as the layout is using it.
+        Returns false if the file can't be read or isn't a valid layout.
+    */
+    bool loadFromFile (const File& file);
+
     //==============================================================================
     /** A positioned glyph. */
     class JUCE_API  Glyph
@@ -109,6 +288,13 @@ public:
         Run() noexcept;
         Run (const Run&);
         Run (const Range<int>& stringRange, int numGlyphsToPreallocate);
+       #if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+        Run (Run&&) noexcept;
+        Run& operator= (Run&&) noexcept;
+
+        /** Creates a run which takes over an array of glyphs that has already been filled. */
+        Run (const Range<int>& stringRange, Array<Glyph>&& glyphs) noexcept;
+       #endif
         ~Run() noexcept;
 
         Font font;              /**< The run's font. */
@@ -130,9 +316,17 @@ public:
         Line (const Line&);
         Line (const Range<int>& stringRange, const Point<float>& lineOrigin,
               float ascent, float descent, float leading, int numRunsToPreallocate);
+       #if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+        Line (Line&&) noexcept;
+        Line& operator= (Line&&) noexcept;
+       #endif
         ~Line() noexcept;
 
-        /** Returns the X position range which contains all the glyphs in this line. */
+        /** Returns the X position range which contains all the glyphs in this line.
+            For lines that belong to a TextLayout, the glyph extents are measured once when
+            the layout is built, so this is a quick operation. Moving the lineOrigin doesn't
+            affect the cached value.
+        */
         Range<float> getLineBoundsX() const noexcept;
 
         OwnedArray<Run> runs;           /**< The glyph-runs in this line. */
@@ -142,6 +336,11 @@ public:
         float ascent, descent, leading;
 
     private:
+        Range<float> glyphBoundsX;  // relative to lineOrigin, only valid if hasGlyphBoundsX is true
+        bool hasGlyphBoundsX;
+
+        friend class TextLayout;
+        Range<float> calculateGlyphBoundsX() const noexcept;
         Line& operator= (const Line&);
         JUCE_LEAK_DETECTOR (Line);
     };
@@ -154,26 +353,136 @@ public:
     float getHeight() const noexcept;
 
     /** Returns the number of lines in the layout. */
-    int getNumLines() const noexcept    { return lines.size(); }
+    int getNumLines() const noexcept;
+
+    /** Returns one of the lines.
 
-    /** Returns one of the lines. */
+        Because the line that is returned can be modified, this gives the layout its own
+        copy of any data that it is sharing with other layouts. If the layout is using
+        flatStorage or compactStorage, this will also convert it back to Line and Run objects.
+    */
     Line& getLine (int index) const;
 
     /** Adds a line to the layout. The layout will take ownership of this line object
         and will delete it when it is no longer needed. */
     void addLine (Line* line);
 
+   #if JUCE_COMPILER_SUPPORTS_MOVE_SEMANTICS
+    /** Adds a line to the layout, moving the contents of the given line into it.
+        The runs and glyphs are taken over rather than copied, and the object that holds
+        them may be one that the layout is re-using from a previous layout.
+    */
+    void addLine (Line&& line);
+   #endif
+
+    /** Returns a new, empty line, re-using one from a previous layout if possible.
+
+        When a layout is re-created, its old Line and Run objects and their glyph storage are
+        kept by the layout and handed out again by createLine() and createRun(), so repeatedly
+        laying out similar text doesn't need to touch the heap. The object that is returned
+        should be passed to addLine(), or deleted by the caller.
+    */
+    Line* createLine();
+
+    /** Returns a new, empty line, re-using one from a previous layout if possible.
+        @see createLine
+    */
+    Line* createLine (const Range<int>& stringRange, const Point<float>& lineOrigin,
+                      float ascent, float descent, float leading, int numRunsToPreallocate);
+
+    /** Returns a new, empty run, re-using one from a previous layout if possible.
+        The object that is returned should be added to one of this layout's lines, or
+        deleted by the caller.
+        @see createLine
+    */
+    Run* createRun (const Range<int>& stringRange, int numGlyphsToPreallocate);
+
     /** Pre-allocates space for the specified number of lines. */
     void ensureStorageAllocated (int numLinesNeeded);
 
+    /** Sets limits on the storage that each thread keeps from deleted layouts.
+
+        When a TextLayout is deleted, its unused Line and Run objects are kept in a pool
+        belonging to the current thread, and are given to the next layouts that are created
+        on that thread. So a list which keeps creating and deleting layouts as it scrolls will
+        soon stop needing to allocate anything.
+
+        @param maxLayoutsPerThread  the number of deleted layouts' storage that each thread keeps
+        @param maxLinesPerLayout    the number of spare Line objects kept for each of these layouts
+        @param maxRunsPerLayout     the number of spare Run objects kept for each of these layouts
+    */
+    static void setStoragePoolLimits (int maxLayoutsPerThread, int maxLinesPerLayout, int maxRunsPerLayout);
+
+    /** Deletes the storage that the current thread has kept from deleted layouts.
+
+        A thread that deletes layouts should call this just before it finishes, or its pool
+        will only be freed when the app shuts down. The pools of all threads are deleted by
+        shutdownJuce_GUI(), along with the other DeletedAtShutdown objects, and pooling starts
+        again if JUCE is initialised again afterwards.
+        @see setStoragePoolLimits
+    */
+    static void releaseCurrentThreadStorage();
+
+    //==============================================================================
+    /** Statistics about the cache of shaped words that's used by the standard layout engine.
+        @see getWordCacheStats
+    */
+    struct WordCacheStats
+    {
+        WordCacheStats() noexcept  : hits (0), misses (0), numEntries (0), bytesUsed (0), maxBytes (0) {}
+
+        int64 hits;         /**< The number of words that were found in the cache. */
+        int64 misses;       /**< The number of words that had to be shaped. */
+        int numEntries;     /**< The number of words currently in the cache. */
+        size_t bytesUsed;   /**< The approximate amount of memory that the cache is using. */
+        size_t maxBytes;    /**< The cache's memory budget. */
+    };
+
+    /** Sets the memory budget for the cache of shaped words.
+
+        When the platform's native layout engine isn't available, each word of a layout is
+        shaped with Font::getGlyphPositions(). The results are kept in a cache that's shared
+        by all threads, so that words which keep appearing in different layouts only need
+        to be shaped once. When the cache grows beyond this size, the least recently used
+        words are discarded. A size of zero turns the cache off. The default is 1MB.
+    */
+    static void setWordCacheSize (size_t maxBytes);
+
+    /** Empties the cache of shaped words, and resets its hit and miss counts. */
+    static void clearWordCache();
+
+    /** Returns the current statistics for the cache of shaped words. */
+    static WordCacheStats getWordCacheStats();
+
 private:
-    OwnedArray<Line> lines;
+    class GlyphStore;
+    class Arena;
+    class SharedData;
+    class StoragePool;
+
+    mutable ReferenceCountedObjectPtr<SharedData> data;
+    mutable ScopedPointer<Arena> arena;
     float width;
     Justification justification;
+    StorageMode storageMode;
+    mutable ScopedPointer<ShapedText> shapedText;  // the standard engine's tokens for the current lines, if any
+    float shapedTextWidth;                          // the maxWidth that shapedText was laid out at
 
-    void createStandardLayout (const AttributedString&);
+    void createStandardLayout (const AttributedString&, bool useOptimalLineBreaks);
     bool createNativeLayout (const AttributedString&);
-    void recalculateWidth(const AttributedString&);
+    void layOutShapedText (const ShapedText&, bool useOptimalLineBreaks, bool canKeepExistingLines);
+    bool updateShapedLayout (const AttributedString&, float maxWidth, bool useOptimalLineBreaks);
+    bool updateShapedLayoutAfterEdit (const AttributedString&, float maxWidth, const Range<int>&, int);
+    void finishLayout (const AttributedString&, bool isNativeLayout);
+    void recalculateWidth (const AttributedString&, bool isNativeLayout);
+    void cacheLineBounds();
+    Range<float> getLineBoundsX (int lineIndex) const noexcept;
+    void flattenLines();
+    void expandLines() const;
+    Arena& getArena() const;
+    SharedData& getWritableData() const;
+    void clearLines();
+    void releaseStorageToPool();
 
     JUCE_LEAK_DETECTOR (TextLayout);
 };
@@ -0,0 +1,278 @@
+#!/usr/bin/perl
+#
+#  Generates juce_TextLayoutUnicodeData.h from the Unicode Character Database that ships
+#  with Perl. Run it from this directory with:
+#
+#      perl juce_TextLayoutUnicodeData.pl > juce_TextLayoutUnicodeData.h
+#
+#  The class orders used here must match the BidiClass and LineBreakClass enums in
+#  juce_TextLayout.cpp.
+
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invmap);
+
+my $unicodeVersion = Unicode::UCD::UnicodeVersion();
+
+sub printArray
+{
+    my ($type, $name, $perLine, $format, @values) = @_;
+    print "    static const $type ${name}[] =\n    {\n";
+
+    for (my $i = 0; $i < @values; $i += $perLine)
+    {
+        my $last = $i + $perLine - 1;
+        $last = $#values if $last > $#values;
+        print "        ", join (", ", map { sprintf ($format, $_) } @values[$i..$last]), ($last < $#values ? "," : ""), "\n";
+    }
+
+    print "    };\n";
+}
+
+# Expands an inversion map into a value for every code point.
+sub expand
+{
+    my ($list, $map, $lookup, $default) = @_;
+    my @values;
+
+    for my $i (0..$#$list)
+    {
+        last if $list->[$i] > 0x10ffff;
+        my $end = ($i < $#$list) ? $list->[$i + 1] : 0x110000;
+        $end = 0x110000 if $end > 0x110000;
+        my $value = exists $lookup->{$map->[$i]} ? $lookup->{$map->[$i]} : $default;
+        $values[$_] = $value for ($list->[$i] .. $end - 1);
+    }
+
+    return @values;
+}
+
+#==============================================================================
+my @bidiClasses = qw(L R AL EN ES ET AN CS NSM BN B S WS ON LRE LRO RLE RLO PDF LRI RLI FSI PDI);
+my %bidiIndex;
+@bidiIndex{@bidiClasses} = (0..$#bidiClasses);
+
+my ($bidiList, $bidiMap) = prop_invmap ("Bidi_Class");
+my @bidiRanges;
+
+for my $i (0..$#$bidiList)
+{
+    last if $bidiList->[$i] > 0x10ffff;
+    push @bidiRanges, ($bidiList->[$i] << 8) | $bidiIndex{$bidiMap->[$i]};
+}
+
+my @bidiValues = expand ($bidiList, $bidiMap, \%bidiIndex, 0);
+
+#==============================================================================
+# The line-breaking classes, with the ones that the pair table covers first. The classes
+# that LB1 says to resolve into others are mapped as it suggests (with SA treated as AL).
+my @pairClasses = qw(OP CL CP QU GL NS EX SY IS PR PO NU AL HL ID IN HY BA BB B2 ZW CM WJ H2 H3 JL JV JT RI EB EM ZWJ CB);
+my @otherClasses = qw(SP BK CR LF NL);
+my %breakIndex;
+@breakIndex{@pairClasses, @otherClasses} = (0 .. @pairClasses + @otherClasses - 1);
+$breakIndex{$_} = $breakIndex{AL} for qw(AI SG XX SA Unknown);
+$breakIndex{CJ} = $breakIndex{NS};
+
+my ($breakList, $breakMap) = prop_invmap ("Line_Break");
+my @breakValues = expand ($breakList, $breakMap, \%breakIndex, $breakIndex{AL});
+
+# The two-stage table: the code points are split into blocks, and identical blocks are shared.
+my $blockShift = 7;
+my $blockSize = 1 << $blockShift;
+my (@blockIndexes, @blocks, %blockNumbers);
+
+for (my $start = 0; $start < 0x110000; $start += $blockSize)
+{
+    my $key = join (",", @breakValues[$start .. $start + $blockSize - 1]);
+
+    if (! exists $blockNumbers{$key})
+    {
+        $blockNumbers{$key} = scalar (@blocks) / $blockSize;
+        push @blocks, @breakValues[$start .. $start + $blockSize - 1];
+    }
+
+    push @blockIndexes, $blockNumbers{$key};
+}
+
+# The pair table is worked out from the rules in UAX #14. For each pair of classes, it
+# finds whether a break is prohibited when they're next to each other, and when there
+# are spaces between them.
+sub isIn { my ($c, @set) = @_; return scalar grep { $_ eq $c } @set; }
+
+sub isProhibitedDirectly
+{
+    my ($a, $b) = @_;
+
+    return 1 if $b eq "ZW";                                                 # LB7
+    return 0 if $a eq "ZW";                                                 # LB8
+    return 1 if $a eq "ZWJ";                                                # LB8a
+    return 1 if $a eq "WJ" || $b eq "WJ";                                   # LB11
+    return 1 if $a eq "GL";                                                 # LB12
+    return 1 if $b eq "GL" && ! isIn ($a, qw(BA HY));                       # LB12a
+    return 1 if isIn ($b, qw(CL CP EX IS SY));                              # LB13
+    return 1 if $a eq "OP";                                                 # LB14
+    return 1 if $a eq "QU" && $b eq "OP";                                   # LB15
+    return 1 if isIn ($a, qw(CL CP)) && $b eq "NS";                         # LB16
+    return 1 if $a eq "B2" && $b eq "B2";                                   # LB17
+    return 1 if $a eq "QU" || $b eq "QU";                                   # LB19
+    return 0 if $a eq "CB" || $b eq "CB";                                   # LB20
+    return 1 if isIn ($b, qw(BA HY NS)) || $a eq "BB";                      # LB21
+    return 1 if $a eq "SY" && $b eq "HL";                                   # LB21b
+    return 1 if $b eq "IN";                                                 # LB22
+    return 1 if isIn ($a, qw(AL HL)) && $b eq "NU";                         # LB23
+    return 1 if $a eq "NU" && isIn ($b, qw(AL HL));
+    return 1 if $a eq "PR" && isIn ($b, qw(ID EB EM));                      # LB23a
+    return 1 if isIn ($a, qw(ID EB EM)) && $b eq "PO";
+    return 1 if isIn ($a, qw(PR PO)) && isIn ($b, qw(AL HL));               # LB24
+    return 1 if isIn ($a, qw(AL HL)) && isIn ($b, qw(PR PO));
+    return 1 if isIn ($a, qw(CL CP NU)) && isIn ($b, qw(PO PR));            # LB25
+    return 1 if isIn ($a, qw(PO PR)) && isIn ($b, qw(OP NU));
+    return 1 if isIn ($a, qw(HY IS NU SY)) && $b eq "NU";
+    return 1 if $a eq "JL" && isIn ($b, qw(JL JV H2 H3));                   # LB26
+    return 1 if isIn ($a, qw(JV H2)) && isIn ($b, qw(JV JT));
+    return 1 if isIn ($a, qw(JT H3)) && $b eq "JT";
+    return 1 if isIn ($a, qw(JL JV JT H2 H3)) && $b eq "PO";                # LB27
+    return 1 if $a eq "PR" && isIn ($b, qw(JL JV JT H2 H3));
+    return 1 if isIn ($a, qw(AL HL)) && isIn ($b, qw(AL HL));               # LB28
+    return 1 if $a eq "IS" && isIn ($b, qw(AL HL));                         # LB29
+    return 1 if isIn ($a, qw(AL HL NU)) && $b eq "OP";                      # LB30
+    return 1 if $a eq "CP" && isIn ($b, qw(AL HL NU));
+    return 1 if $a eq "RI" && $b eq "RI";                                   # LB30a
+    return 1 if $a eq "EB" && $b eq "EM";                                   # LB30b
+    return 0;                                                               # LB31
+}
+
+sub isProhibitedAfterSpaces
+{
+    my ($a, $b) = @_;
+
+    return 1 if $b eq "ZW";                                                 # LB7
+    return 0 if $a eq "ZW";                                                 # LB8
+    return 1 if $b eq "WJ";                                                 # LB11
+    return 1 if isIn ($b, qw(CL CP EX IS SY));                              # LB13
+    return 1 if $a eq "OP";                                                 # LB14
+    return 1 if $a eq "QU" && $b eq "OP";                                   # LB15
+    return 1 if isIn ($a, qw(CL CP)) && $b eq "NS";                         # LB16
+    return 1 if $a eq "B2" && $b eq "B2";                                   # LB17
+    return 0;                                                               # LB18
+}
+
+# 0 = break, 1 = break only after spaces, 2 = a combining mark that can start a new
+# unit after spaces, 3 = a combining mark that can't be separated, 4 = never break.
+sub getPairAction
+{
+    my ($a, $b) = @_;
+    $a = "AL" if $a eq "CM";                                                # LB10
+
+    if (isIn ($b, qw(CM ZWJ)))
+    {
+        return 0 if $a eq "ZW";
+        return isProhibitedAfterSpaces ($a, "AL") ? 3 : 2;                  # LB9 and LB10
+    }
+
+    return 4 if isProhibitedAfterSpaces ($a, $b);
+    return 1 if isProhibitedDirectly ($a, $b);
+    return 0;
+}
+
+my @pairTable;
+
+for my $a (@pairClasses)
+{
+    push @pairTable, map { getPairAction ($a, $_) } @pairClasses;
+}
+
+#==============================================================================
+print <<"EOF";
+/*
+  ==============================================================================
+
+   This file is part of the JUCE library - "Jules' Utility Class Extensions"
+   Copyright 2004-11 by Raw Material Software Ltd.
+
+  ------------------------------------------------------------------------------
+
+   JUCE can be redistributed and/or modified under the terms of the GNU General
+   Public License (Version 2), as published by the Free Software Foundation.
+   A copy of the license is included in the JUCE distribution, or can be found
+   online at www.gnu.org/licenses.
+
+   JUCE is distributed in the hope that it will be useful, but WITHOUT ANY
+   WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+   A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  ------------------------------------------------------------------------------
+
+   To release a closed-source product which uses JUCE, commercial licenses are
+   available: visit www.rawmaterialsoftware.com/juce for more information.
+
+  ==============================================================================
+*/
+
+#ifndef __JUCE_TEXTLAYOUTUNICODEDATA_JUCEHEADER__
+#define __JUCE_TEXTLAYOUTUNICODEDATA_JUCEHEADER__
+
+// This file is only intended to be included by juce_TextLayout.cpp
+
+//==============================================================================
+/*  Unicode character property tables used by the standard TextLayout engine.
+
+    These tables are generated by juce_TextLayoutUnicodeData.pl from the Unicode
+    Character Database that ships with Perl (Unicode $unicodeVersion), so don't edit them
+    by hand - re-run the script instead.
+*/
+namespace TextLayoutUnicodeData
+{
+    //==============================================================================
+    /*  The Bidi_Class of every code point, as a sorted list of ranges.
+
+        Each entry is (firstCodePointOfRange << 8) | bidiClass, and a range continues up
+        to the start of the next entry. The class numbers are the order of the BidiClass
+        enum in juce_TextLayout.cpp.
+    */
+EOF
+
+printArray ("uint32", "bidiClassRanges", 8, "0x%08x", @bidiRanges);
+
+print "\n    // The same classes for the first 256 code points, so that they can be found directly.\n";
+printArray ("uint8", "latin1BidiClasses", 16, "%2d", @bidiValues[0..255]);
+
+print <<"EOF";
+
+    //==============================================================================
+    /*  The Line_Break class of every code point, as a two-stage table: the top bits of a
+        code point pick one of the blocks in lineBreakBlocks, and the bottom bits pick the
+        class within it. The class numbers are the order of the LineBreakClass enum in
+        juce_TextLayout.cpp, with the classes that rule LB1 resolves already mapped.
+    */
+    enum { lineBreakBlockShift = $blockShift };
+
+EOF
+
+die "too many blocks" if @blocks / $blockSize > 256;
+printArray ("uint8", "lineBreakBlockIndexes", 32, "%3d", @blockIndexes);
+print "\n";
+printArray ("uint8", "lineBreakBlocks", 32, "%2d", @blocks);
+
+my $numPairClasses = scalar @pairClasses;
+
+print <<"EOF";
+
+    /*  What may happen between each pair of the first $numPairClasses line-breaking classes, as
+        worked out from the rules in UAX #14. The row is the class before the position, and
+        the column is the class after it. The values are the LineBreakAction enum in
+        juce_TextLayout.cpp: 0 = a break is allowed, 1 = a break is only allowed if there
+        are spaces in between, 2 and 3 = the second is a combining mark (which can or can't
+        start a new unit after spaces), and 4 = a break is never allowed.
+    */
+    enum { numLineBreakPairClasses = $numPairClasses };
+
+EOF
+
+printArray ("uint8", "lineBreakPairs", $numPairClasses, "%d", @pairTable);
+
+print <<"EOF";
+}
+
+#endif   // __JUCE_TEXTLAYOUTUNICODEDATA_JUCEHEADER__
+EOF
@@ -301,9 +301,9 @@ namespace CoreTextTypeLayout
             CGFloat ascent, descent, leading;
             CTLineGetTypographicBounds (line, &ascent,  &descent, &leading);
 
-            TextLayout::Line* const glyphLine = new TextLayout::Line (lineStringRange, lineOrigin,
-                                                                      (float) ascent, (float) descent, (float) leading,
-                                                                      (int) numRuns);
+            TextLayout::Line* const glyphLine = glyphLayout.createLine (lineStringRange, lineOrigin,
+                                                                        (float) ascent, (float) descent, (float) leading,
+                                                                        (int) numRuns);
             glyphLayout.addLine (glyphLine);
 
             for (CFIndex j = 0; j < numRuns; ++j)
@@ -312,9 +312,9 @@ namespace CoreTextTypeLayout
                 const CFIndex numGlyphs = CTRunGetGlyphCount (run);
                 const CFRange runStringRange = CTRunGetStringRange (run);
 
-                TextLayout::Run* const glyphRun = new TextLayout::Run (Range<int> ((int) runStringRange.location,
-                                                                                   (int) (runStringRange.location + runStringRange.length - 1)),
-                                                                       (int) numGlyphs);
+                TextLayout::Run* const glyphRun = glyphLayout.createRun (Range<int> ((int) runStringRange.location,
+                                                                                     (int) (runStringRange.location + runStringRange.length - 1)),
+                                                                         (int) numGlyphs);
                 glyphLine->runs.add (glyphRun);
 
                 CFDictionaryRef runAttributes = CTRunGetAttributes (run);
@@ -75,7 +75,7 @@ namespace DirectWriteTypeLayout
                 if (currentLine >= layout->getNumLines())
                 {
                     jassert (currentLine == layout->getNumLines());
-                    TextLayout::Line* const newLine = new TextLayout::Line();
+                    TextLayout::Line* const newLine = layout->createLine();
                     layout->addLine (newLine);
                     newLine->lineOrigin = Point<float> (baselineOriginX, baselineOriginY);
                 }
@@ -92,9 +92,9 @@ namespace DirectWriteTypeLayout
             String fontFamily, fontStyle;
             getFontFamilyAndStyle (glyphRun, fontFamily, fontStyle);
 
-            TextLayout::Run* const glyphRunLayout = new TextLayout::Run (Range<int> (runDescription->textPosition,
-                                                                                     runDescription->textPosition + runDescription->stringLength),
-                                                                         glyphRun->glyphCount);
+            TextLayout::Run* const glyphRunLayout = layout->createRun (Range<int> (runDescription->textPosition,
+                                                                                   runDescription->textPosition + runDescription->stringLength),
+                                                                       glyphRun->glyphCount);
             glyphLine.runs.add (glyphRunLayout);
 
             glyphRun->fontFace->GetMetrics (&dwFontMetrics);